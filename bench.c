@@ -0,0 +1,777 @@
+/**
+ *  bench.c
+ *  lame-obj-c
+ *
+ *  Benchmarks for the object system. `make bench` builds it.
+ *
+ *  Each case gets calibrated until one sample takes a couple of
+ *  milliseconds, warmed up, then timed over a number of samples. Latency is
+ *  per operation at a few percentiles over those samples, next to the
+ *  allocations and bytes per operation a counting allocator saw.
+ *
+ *  ./bench                      everything but the parallel cases
+ *  ./bench cons                 only cases whose name starts with "cons"
+ *  ./bench --json               one JSON object per line instead of a table
+ *  ./bench --parallel 10000000  parallel map/reduce/sort, 0 to ncpu workers
+ *
+ *  The _fast cases use lame-obj-c-inline.h, so build with -DNDEBUG to see
+ *  them without the type checks. cons_traverse at 100 fits in L1 and shows
+ *  what the calls cost; the bigger lists are mostly waiting on memory.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lame-obj-c-inline.h"
+
+#pragma mark Harness
+
+typedef void(*BenchFunc)(long size);
+typedef void(*BenchRunFunc)(long size, long operations);
+
+typedef struct BenchCase {
+    const char *name;
+    long size;
+    /* Called once around the whole case, untimed. */
+    BenchFunc setup;
+    BenchFunc teardown;
+    /* Called before every sample, untimed. */
+    BenchFunc prepare;
+    /* Does operations operations. Only this is timed. */
+    BenchRunFunc run;
+    /* 0 means kSamples. */
+    int samples;
+    /* Skips calibration and does exactly this many operations per sample. */
+    long operations;
+} BenchCase;
+
+static const int kSamples = 25;
+static const int kWarmupSamples = 2;
+static const double kTargetSampleTime = 0.002;
+static const long kMaxOperations = 1L << 30;
+
+static CountingAllocatorContext _counting;
+static BOOL _json = NO;
+
+double Now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double TimeSample(BenchCase *benchCase, long operations) {
+    if (benchCase->prepare) {
+        benchCase->prepare(benchCase->size);
+    }
+    double start = Now();
+    benchCase->run(benchCase->size, operations);
+    return Now() - start;
+}
+
+int CompareDoubles(const void *valueZero, const void *valueOne) {
+    double zero = *(const double *)valueZero;
+    double one = *(const double *)valueOne;
+    return zero < one ? -1 : zero > one;
+}
+
+/* Nearest rank, values has to be sorted. */
+double Percentile(double *values, int count, double percentile) {
+    int rank = (int)ceil(percentile / 100.0 * count);
+    return values[rank > 0 ? rank - 1 : 0];
+}
+
+void PrintHeader() {
+    if (!_json) {
+        printf("benchmark\tsize\tops\tsamples\tmin_ns\tp50_ns\tp90_ns\tp99_ns\tmax_ns\tallocs_per_op\tbytes_per_op\n");
+    }
+}
+
+void RunCase(BenchCase *benchCase) {
+    int samples = benchCase->samples ? benchCase->samples : kSamples;
+    long operations = benchCase->operations;
+    int i = 0;
+
+    if (benchCase->setup) {
+        benchCase->setup(benchCase->size);
+    }
+
+    /* Calibrating doubles as the first bit of warm up. */
+    if (!operations) {
+        operations = 1;
+        while (TimeSample(benchCase, operations) < kTargetSampleTime && operations < kMaxOperations) {
+            operations *= 2;
+        }
+    }
+    for (i = 0; i < kWarmupSamples; i++) {
+        TimeSample(benchCase, operations);
+    }
+
+    /* Setup can swap allocators, which starts the counts over, so only look
+     * at them from here on. */
+    unsigned long allocationsBefore = _counting.allocations;
+    size_t bytesBefore = _counting.bytesAllocated;
+    double *perOperation = malloc(samples * sizeof(double));
+    for (i = 0; i < samples; i++) {
+        perOperation[i] = TimeSample(benchCase, operations) / operations * 1e9;
+    }
+    double totalOperations = (double)operations * samples;
+    double allocationsPerOperation = (_counting.allocations - allocationsBefore) / totalOperations;
+    double bytesPerOperation = (_counting.bytesAllocated - bytesBefore) / totalOperations;
+
+    qsort(perOperation, samples, sizeof(double), &CompareDoubles);
+
+    if (_json) {
+        printf("{\"benchmark\": \"%s\", \"size\": %ld, \"ops\": %ld, \"samples\": %d, "
+               "\"min_ns\": %.3f, \"p50_ns\": %.3f, \"p90_ns\": %.3f, \"p99_ns\": %.3f, \"max_ns\": %.3f, "
+               "\"allocs_per_op\": %.3f, \"bytes_per_op\": %.1f}\n",
+               benchCase->name, benchCase->size, operations, samples,
+               perOperation[0], Percentile(perOperation, samples, 50), Percentile(perOperation, samples, 90),
+               Percentile(perOperation, samples, 99), perOperation[samples - 1],
+               allocationsPerOperation, bytesPerOperation);
+    } else {
+        printf("%s\t%ld\t%ld\t%d\t%.2f\t%.2f\t%.2f\t%.2f\t%.2f\t%.3f\t%.1f\n",
+               benchCase->name, benchCase->size, operations, samples,
+               perOperation[0], Percentile(perOperation, samples, 50), Percentile(perOperation, samples, 90),
+               Percentile(perOperation, samples, 99), perOperation[samples - 1],
+               allocationsPerOperation, bytesPerOperation);
+    }
+    fflush(stdout);
+
+    free(perOperation);
+    if (benchCase->teardown) {
+        benchCase->teardown(benchCase->size);
+    }
+}
+
+BOOL CaseMatches(const char *name, const char *filter) {
+    return !filter || strncmp(name, filter, strlen(filter)) == 0;
+}
+
+#pragma mark Fixtures
+
+static ConsRef _list = nil;
+static ConsRef _listLast = nil;
+static StringRef _stringZero = nil;
+static StringRef _stringOne = nil;
+static StringRef _needle = nil;
+static Object _filler = nil;
+/* size objects in runs of kObjectRun, like a list that repeats itself. */
+static Object *_objects = NULL;
+static const long kObjectRun = 8;
+
+/* size cells, each holding _filler. */
+ConsRef MakeList(long size) {
+    ConsRef list = nil;
+    long i = 0;
+
+    for (i = 0; i < size; i++) {
+        ConsRef newList = ConsCreate(_filler, list);
+        Release(list);
+        list = newList;
+    }
+    return list;
+}
+
+/* Pseudo random lowercase letters so searches don't hit early by accident. */
+StringRef MakeString(long size, unsigned int seed) {
+    char *characters = malloc(size + 1);
+    long i = 0;
+
+    for (i = 0; i < size; i++) {
+        seed = seed * 1103515245 + 12345;
+        characters[i] = 'a' + (seed >> 16) % 26;
+    }
+    characters[size] = '\0';
+
+    StringRef string = StringCreate(characters);
+    free(characters);
+    return string;
+}
+
+void SetupList(long size) {
+    _list = MakeList(size);
+    _listLast = _list;
+    while (_listLast && ConsCdr(_listLast)) {
+        _listLast = ConsCdr(_listLast);
+    }
+}
+
+void TeardownList(long size) {
+    Release(_list);
+    _list = nil;
+    _listLast = nil;
+}
+
+void SetupObjects(long size) {
+    long i = 0;
+    _objects = malloc(size * sizeof(Object));
+    for (i = 0; i < size; i++) {
+        _objects[i] = i % kObjectRun ? _objects[i - 1] : CharCreate('o');
+    }
+}
+
+void TeardownObjects(long size) {
+    long i = 0;
+    for (i = 0; i < size; i += kObjectRun) {
+        Release(_objects[i]);
+    }
+    free(_objects);
+    _objects = NULL;
+}
+
+/* Two equal strings, and a needle that only shows up at the very end. */
+void SetupStrings(long size) {
+    long needleLength = size < 8 ? size : 8;
+    _stringZero = MakeString(size, 1);
+    _stringOne = MakeString(size, 1);
+    _needle = StringCreateSubstring(_stringZero, size - needleLength, needleLength);
+}
+
+void TeardownStrings(long size) {
+    Release(_needle);
+    Release(_stringZero);
+    Release(_stringOne);
+    _needle = nil;
+    _stringZero = nil;
+    _stringOne = nil;
+}
+
+#pragma mark Objects
+
+static BumpAllocatorContext _bump;
+static void *_bumpBuffer = NULL;
+static const size_t kBumpBufferSize = 16 * 1024 * 1024;
+
+void RunObjectCreateRelease(long size, long operations) {
+    long i = 0;
+    for (i = 0; i < operations; i++) {
+        Release(CharCreate('x'));
+    }
+}
+
+void RunRetainRelease(long size, long operations) {
+    long i = 0;
+    for (i = 0; i < operations; i++) {
+        Retain(_filler);
+        Release(_filler);
+    }
+}
+
+void RunRetainReleaseFast(long size, long operations) {
+    long i = 0;
+    for (i = 0; i < operations; i++) {
+        RetainFast(_filler);
+        ReleaseFast(_filler);
+    }
+}
+
+/* The bump allocator never gets anything back, so it starts over whenever
+ * it runs low and after every sample. */
+void RunObjectCreateReleaseBump(long size, long operations) {
+    long i = 0;
+    for (i = 0; i < operations; i++) {
+        Release(CharCreate('x'));
+        if (_bump.offset > kBumpBufferSize - 1024) {
+            BumpAllocatorReset(&_bump);
+        }
+    }
+    BumpAllocatorReset(&_bump);
+}
+
+void SetupBumpAllocator(long size) {
+    _bumpBuffer = malloc(kBumpBufferSize);
+    SetupObjectSystemWithAllocator(CountingAllocatorMake(&_counting, BumpAllocatorMake(&_bump, _bumpBuffer, kBumpBufferSize)));
+}
+
+void TeardownBumpAllocator(long size) {
+    SetupObjectSystemWithAllocator(CountingAllocatorMake(&_counting, DefaultAllocator()));
+    free(_bumpBuffer);
+    _bumpBuffer = NULL;
+}
+
+/* One operation is one AutoRelease, with a drain every size of them. */
+void RunAutoReleaseChurn(long size, long operations) {
+    long i = 0;
+    AutoReleasePoolCreate();
+    for (i = 0; i < operations; i++) {
+        AutoRelease(CharCreate('x'));
+        if ((i + 1) % size == 0) {
+            AutoReleasePoolDrain();
+            AutoReleasePoolCreate();
+        }
+    }
+    AutoReleasePoolDrain();
+}
+
+#pragma mark Cons
+
+void RunConsPush(long size, long operations) {
+    long i = 0;
+    for (i = 0; i < operations; i++) {
+        AutoReleasePoolCreate();
+        ConsPush(_list, _filler);
+        AutoReleasePoolDrain();
+    }
+}
+
+void RunConsPop(long size, long operations) {
+    long i = 0;
+    Object popped = nil;
+    for (i = 0; i < operations; i++) {
+        AutoReleasePoolCreate();
+        ConsPop(_list, &popped);
+        AutoReleasePoolDrain();
+    }
+}
+
+/* Adds to the end, then chops it back off so the list stays size long. */
+void RunConsAddToEnd(long size, long operations) {
+    long i = 0;
+    for (i = 0; i < operations; i++) {
+        AutoReleasePoolCreate();
+        ConsAddToEnd(_list, _filler);
+        ConsSetCdr(_listLast, nil);
+        AutoReleasePoolDrain();
+    }
+}
+
+/* One operation is one cell. Starting over happens in the outer loop so the
+ * compiler can't turn it into a conditional move on the pointer being
+ * chased, which would make every step wait on it. */
+void RunConsTraverse(long size, long operations) {
+    long remaining = operations;
+    long visited = 0;
+    ConsRef cons = nil;
+    while (remaining > 0) {
+        for (cons = _list; cons && remaining > 0; cons = ConsCdr(cons), remaining--) {
+            visited += ConsCar(cons) != nil;
+        }
+    }
+    if (visited != operations) {
+        printf("cons_traverse lost a car.\n");
+    }
+}
+
+/* One operation is one element. Lists get built size long then let go. */
+void RunConsBuild(long size, long operations) {
+    long remaining = operations;
+    while (remaining > 0) {
+        long length = remaining < size ? remaining : size;
+        ConsRef list = nil;
+        long i = 0;
+        for (i = 0; i < length; i++) {
+            ConsRef newList = ConsCreate(_objects[length - 1 - i], list);
+            Release(list);
+            list = newList;
+        }
+        Release(list);
+        remaining -= length;
+    }
+}
+
+void RunConsBuildFromArray(long size, long operations) {
+    long remaining = operations;
+    while (remaining > 0) {
+        long length = remaining < size ? remaining : size;
+        Release(ConsCreateFromArray(_objects, length));
+        remaining -= length;
+    }
+}
+
+/* One operation is one object retained and released. */
+void RunRetainReleaseEach(long size, long operations) {
+    long remaining = operations;
+    long i = 0;
+    while (remaining > 0) {
+        long length = remaining < size ? remaining : size;
+        for (i = 0; i < length; i++) {
+            Retain(_objects[i]);
+        }
+        for (i = 0; i < length; i++) {
+            Release(_objects[i]);
+        }
+        remaining -= length;
+    }
+}
+
+void RunRetainReleaseMany(long size, long operations) {
+    long remaining = operations;
+    while (remaining > 0) {
+        long length = remaining < size ? remaining : size;
+        RetainMany(_objects, length);
+        ReleaseMany(_objects, length);
+        remaining -= length;
+    }
+}
+
+void RunConsTraverseFast(long size, long operations) {
+    long remaining = operations;
+    long visited = 0;
+    ConsRef cons = nil;
+    while (remaining > 0) {
+        for (cons = _list; cons && remaining > 0; cons = ConsCdrFast(cons), remaining--) {
+            visited += ConsCarFast(cons) != nil;
+        }
+    }
+    if (visited != operations) {
+        printf("cons_traverse_fast lost a car.\n");
+    }
+}
+
+#pragma mark Strings
+
+/* One copying and one no copy create per operation. */
+void RunStringCreate(long size, long operations) {
+    const char *characters = StringBytes(_stringZero);
+    long i = 0;
+    for (i = 0; i < operations; i++) {
+        Release(StringCreateNoCopy(characters, size, NULL, NULL));
+        Release(StringCreate((char *)characters));
+    }
+}
+
+void RunStringEqual(long size, long operations) {
+    long i = 0;
+    long equal = 0;
+    for (i = 0; i < operations; i++) {
+        equal += StringEqual(_stringZero, _stringOne);
+    }
+    if (equal != operations) {
+        printf("StringEqual disagreed with itself.\n");
+    }
+}
+
+void RunStringFind(long size, long operations) {
+    long i = 0;
+    long found = 0;
+    for (i = 0; i < operations; i++) {
+        found += StringFind(_stringZero, _needle) >= 0;
+    }
+    if (found != operations) {
+        printf("StringFind missed.\n");
+    }
+}
+
+void RunStringHash(long size, long operations) {
+    long i = 0;
+    unsigned int hash = 0;
+    for (i = 0; i < operations; i++) {
+        hash += StringHash(_stringZero);
+    }
+    if (operations > 1 && hash == 0) {
+        printf("StringHash came out 0.\n");
+    }
+}
+
+void RunStringConcatenate(long size, long operations) {
+    long i = 0;
+    for (i = 0; i < operations; i++) {
+        AutoReleasePoolCreate();
+        StringConcatenate(_stringZero, _stringOne);
+        AutoReleasePoolDrain();
+    }
+}
+
+void RunStringIterate(long size, long operations) {
+    long i = 0;
+    long characters = 0;
+    for (i = 0; i < operations; i++) {
+        Iterator iterator;
+        IteratorInit(&iterator, _stringZero);
+        while (IteratorNext(&iterator)) {
+            characters += iterator.character != '\0';
+        }
+    }
+    if (characters != size * operations) {
+        printf("string_iterate lost characters.\n");
+    }
+}
+
+static StringKernel _previousKernel = StringKernelScalar;
+
+void SetupKernel(StringKernel kernel, long size) {
+    _previousKernel = StringKernelActive();
+    StringKernelSelect(kernel);
+    SetupStrings(size);
+}
+
+void SetupScalarKernel(long size) { SetupKernel(StringKernelScalar, size); }
+void SetupSSE2Kernel(long size) { SetupKernel(StringKernelSSE2, size); }
+void SetupAVX2Kernel(long size) { SetupKernel(StringKernelAVX2, size); }
+
+void TeardownKernel(long size) {
+    TeardownStrings(size);
+    StringKernelSelect(_previousKernel);
+}
+
+#pragma mark Description
+
+/* A list of size strings, which is most of what gets logged. */
+void SetupDescription(long size) {
+    Object filler = _filler;
+    _filler = StringCreate("value");
+    SetupList(size);
+    Release(_filler);
+    _filler = filler;
+}
+
+void RunDescription(long size, long operations) {
+    long i = 0;
+    for (i = 0; i < operations; i++) {
+        AutoReleasePoolCreate();
+        Description(_list);
+        AutoReleasePoolDrain();
+    }
+}
+
+/* Touching the list first throws the cached description away every time. */
+void RunDescriptionChanged(long size, long operations) {
+    long i = 0;
+    for (i = 0; i < operations; i++) {
+        AutoReleasePoolCreate();
+        ConsSetCar(_list, ConsCar(_list));
+        Description(_list);
+        AutoReleasePoolDrain();
+    }
+}
+
+#pragma mark Parallel
+
+static const int kDistinctRecords = 1024;
+static StringRef *_records = NULL;
+static ThreadPool *_pool = NULL;
+static long _parallelCount = 1000000;
+
+int CompareRecords(Object objZero, Object objOne, void *context) {
+    return memcmp(StringBytes(objZero), StringBytes(objOne), StringLength(objZero));
+}
+
+Object PickRecord(Object obj, void *context) {
+    return _records[StringHash(obj) % kDistinctRecords];
+}
+
+Object LaterRecord(Object accumulator, Object obj, void *context) {
+    if (!accumulator) {
+        return obj;
+    }
+    return CompareRecords(obj, accumulator, context) > 0 ? obj : accumulator;
+}
+
+/* _parallelCount cells picked out of kDistinctRecords shared strings, and
+ * a pool of workers workers (none for 0, which runs the sequential version). */
+void SetupRecords(long workers) {
+    char record[32];
+    unsigned int seed = 1;
+    long i = 0;
+
+    _records = malloc(kDistinctRecords * sizeof(StringRef));
+    for (i = 0; i < kDistinctRecords; i++) {
+        sprintf(record, "record-%04ld", i);
+        _records[i] = StringCreate(record);
+    }
+
+    _list = nil;
+    for (i = 0; i < _parallelCount; i++) {
+        seed = seed * 1103515245 + 12345;
+        ConsRef newList = ConsCreate(_records[(seed >> 16) % kDistinctRecords], _list);
+        Release(_list);
+        _list = newList;
+    }
+
+    _pool = workers ? ThreadPoolCreate((int)workers) : NULL;
+}
+
+void TeardownRecords(long workers) {
+    int i = 0;
+
+    ThreadPoolDestroy(_pool);
+    _pool = NULL;
+    Release(_list);
+    _list = nil;
+    for (i = 0; i < kDistinctRecords; i++) {
+        Release(_records[i]);
+    }
+    free(_records);
+    _records = NULL;
+}
+
+/* Sorting an already sorted list would flatter it, so shuffle first. */
+void PrepareSort(long workers) {
+    unsigned int seed = 7;
+    ConsRef cons = _list;
+    for (; cons; cons = ConsCdr(cons)) {
+        seed = seed * 1103515245 + 12345;
+        ConsSetCar(cons, _records[(seed >> 16) % kDistinctRecords]);
+    }
+}
+
+void RunMap(long workers, long operations) {
+    AutoReleasePoolCreate();
+    _pool ? ConsMapParallel(_pool, _list, &PickRecord, NULL) : ConsMap(_list, &PickRecord, NULL);
+    AutoReleasePoolDrain();
+}
+
+void RunReduce(long workers, long operations) {
+    AutoReleasePoolCreate();
+    _pool ? ConsReduceParallel(_pool, _list, &LaterRecord, &LaterRecord, nil, NULL) : ConsReduce(_list, &LaterRecord, nil, NULL);
+    AutoReleasePoolDrain();
+}
+
+void RunSort(long workers, long operations) {
+    AutoReleasePoolCreate();
+    ConsRef sorted = _pool ? ConsSortParallel(_pool, _list, &CompareRecords, NULL) : ConsSort(_list, &CompareRecords, NULL);
+    /* Hang on to the new head, the old one is somewhere in the middle now. */
+    Retain(sorted);
+    Release(_list);
+    _list = sorted;
+    AutoReleasePoolDrain();
+}
+
+/* One operation is one pass over the whole list. */
+void RunParallelCases(const char *filter) {
+    int maxWorkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    long workers = 0;
+    int i = 0;
+
+    PrintHeader();
+    for (workers = 0; workers <= maxWorkers; workers++) {
+        BenchCase cases[] = {
+            { "cons_map_parallel", workers, &SetupRecords, &TeardownRecords, NULL, &RunMap, 5, 1 },
+            { "cons_reduce_parallel", workers, &SetupRecords, &TeardownRecords, NULL, &RunReduce, 5, 1 },
+            { "cons_sort_parallel", workers, &SetupRecords, &TeardownRecords, &PrepareSort, &RunSort, 3, 1 },
+        };
+        for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+            if (CaseMatches(cases[i].name, filter)) {
+                RunCase(&cases[i]);
+            }
+        }
+    }
+}
+
+#pragma mark Main
+
+void RunCases(const char *filter) {
+    BenchCase cases[] = {
+        { "object_create_release", 1, NULL, NULL, NULL, &RunObjectCreateRelease },
+        { "object_create_release_bump", 1, &SetupBumpAllocator, &TeardownBumpAllocator, NULL, &RunObjectCreateReleaseBump },
+        { "object_retain_release", 1, NULL, NULL, NULL, &RunRetainRelease },
+        { "object_retain_release_fast", 1, NULL, NULL, NULL, &RunRetainReleaseFast },
+        { "object_retain_release_each", 1024, &SetupObjects, &TeardownObjects, NULL, &RunRetainReleaseEach },
+        { "object_retain_release_many", 1024, &SetupObjects, &TeardownObjects, NULL, &RunRetainReleaseMany },
+        { "autorelease_churn", 10, NULL, NULL, NULL, &RunAutoReleaseChurn },
+        { "autorelease_churn", 100, NULL, NULL, NULL, &RunAutoReleaseChurn },
+        { "autorelease_churn", 1000, NULL, NULL, NULL, &RunAutoReleaseChurn },
+        { "cons_push", 10, &SetupList, &TeardownList, NULL, &RunConsPush },
+        { "cons_push", 1000, &SetupList, &TeardownList, NULL, &RunConsPush },
+        { "cons_pop", 10, &SetupList, &TeardownList, NULL, &RunConsPop },
+        { "cons_pop", 1000, &SetupList, &TeardownList, NULL, &RunConsPop },
+        { "cons_append", 10, &SetupList, &TeardownList, NULL, &RunConsAddToEnd },
+        { "cons_append", 1000, &SetupList, &TeardownList, NULL, &RunConsAddToEnd },
+        { "cons_build", 1000, &SetupObjects, &TeardownObjects, NULL, &RunConsBuild },
+        { "cons_build", 1000000, &SetupObjects, &TeardownObjects, NULL, &RunConsBuild },
+        { "cons_build_array", 1000, &SetupObjects, &TeardownObjects, NULL, &RunConsBuildFromArray },
+        { "cons_build_array", 1000000, &SetupObjects, &TeardownObjects, NULL, &RunConsBuildFromArray },
+        { "cons_traverse", 100, &SetupList, &TeardownList, NULL, &RunConsTraverse },
+        { "cons_traverse", 1000, &SetupList, &TeardownList, NULL, &RunConsTraverse },
+        { "cons_traverse", 1000000, &SetupList, &TeardownList, NULL, &RunConsTraverse },
+        { "cons_traverse_fast", 100, &SetupList, &TeardownList, NULL, &RunConsTraverseFast },
+        { "cons_traverse_fast", 1000, &SetupList, &TeardownList, NULL, &RunConsTraverseFast },
+        { "cons_traverse_fast", 1000000, &SetupList, &TeardownList, NULL, &RunConsTraverseFast },
+        { "string_create", 16, &SetupStrings, &TeardownStrings, NULL, &RunStringCreate },
+        { "string_create", 4096, &SetupStrings, &TeardownStrings, NULL, &RunStringCreate },
+        { "string_equal", 16, &SetupStrings, &TeardownStrings, NULL, &RunStringEqual },
+        { "string_equal", 4096, &SetupStrings, &TeardownStrings, NULL, &RunStringEqual },
+        { "string_concat", 16, &SetupStrings, &TeardownStrings, NULL, &RunStringConcatenate },
+        { "string_concat", 4096, &SetupStrings, &TeardownStrings, NULL, &RunStringConcatenate },
+        { "string_iterate", 4096, &SetupStrings, &TeardownStrings, NULL, &RunStringIterate },
+        { "description", 1, &SetupDescription, &TeardownList, NULL, &RunDescription },
+        { "description", 10, &SetupDescription, &TeardownList, NULL, &RunDescription },
+        { "description", 100, &SetupDescription, &TeardownList, NULL, &RunDescription },
+        { "description_changed", 1, &SetupDescription, &TeardownList, NULL, &RunDescriptionChanged },
+        { "description_changed", 10, &SetupDescription, &TeardownList, NULL, &RunDescriptionChanged },
+        { "description_changed", 100, &SetupDescription, &TeardownList, NULL, &RunDescriptionChanged },
+    };
+    struct {
+        const char *name;
+        StringKernel kernel;
+        BenchFunc setup;
+    } kernels[] = {
+        { "scalar", StringKernelScalar, &SetupScalarKernel },
+        { "sse2", StringKernelSSE2, &SetupSSE2Kernel },
+        { "avx2", StringKernelAVX2, &SetupAVX2Kernel },
+    };
+    struct {
+        const char *name;
+        BenchRunFunc run;
+    } kernelRuns[] = {
+        { "kernel_equal", &RunStringEqual },
+        { "kernel_find", &RunStringFind },
+        { "kernel_hash", &RunStringHash },
+    };
+    long sizes[] = { 8, 64, 512, 4096, 32768, 262144, 1048576 };
+    char name[64];
+    int i = 0;
+    int k = 0;
+    int s = 0;
+
+    PrintHeader();
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        if (CaseMatches(cases[i].name, filter)) {
+            RunCase(&cases[i]);
+        }
+    }
+
+    /* Every kernel the CPU can run, 8 bytes to 1MB. */
+    for (i = 0; i < sizeof(kernelRuns) / sizeof(kernelRuns[0]); i++) {
+        for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+            StringKernel activeKernel = StringKernelActive();
+            BOOL supported = StringKernelSelect(kernels[k].kernel);
+            StringKernelSelect(activeKernel);
+
+            sprintf(name, "%s_%s", kernelRuns[i].name, kernels[k].name);
+            if (!supported || !CaseMatches(name, filter)) {
+                continue;
+            }
+            for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+                BenchCase kernelCase = { name, sizes[s], kernels[k].setup, &TeardownKernel, NULL, kernelRuns[i].run };
+                RunCase(&kernelCase);
+            }
+        }
+    }
+}
+
+int main(int argc, const char * argv[])
+{
+    const char *filter = NULL;
+    BOOL parallel = NO;
+    int i = 0;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            _json = YES;
+        } else if (strcmp(argv[i], "--parallel") == 0) {
+            parallel = YES;
+            if (i + 1 < argc && atol(argv[i + 1]) > 0) {
+                _parallelCount = atol(argv[++i]);
+            }
+        } else {
+            filter = argv[i];
+        }
+    }
+
+    SetupObjectSystemWithAllocator(CountingAllocatorMake(&_counting, DefaultAllocator()));
+    _filler = CharCreate('x');
+
+    if (parallel) {
+        RunParallelCases(filter);
+    } else {
+        RunCases(filter);
+    }
+
+    Release(_filler);
+    return 0;
+}
@@ -0,0 +1,65 @@
+# check.awk
+# lame-obj-c
+#
+# main prints "what (expected): actual" or "what 'expected': actual" for the
+# things it checks. Fails if any of those got something other than what
+# they expected, or if there were none at all.
+
+{
+    colon = 0
+    for (i = length($0) - 1; i >= 1; i--) {
+        if (substr($0, i, 2) == ": ") {
+            colon = i
+            break
+        }
+    }
+    if (!colon) {
+        next
+    }
+
+    label = substr($0, 1, colon - 1)
+    actual = substr($0, colon + 2)
+    last = substr(label, length(label), 1)
+
+    if (last == "'") {
+        open = index(label, "'")
+        if (open == length(label)) {
+            next
+        }
+        expected = substr(label, open + 1, length(label) - open - 1)
+    } else if (last == ")") {
+        # Expected values can have their own parens, e.g. ("a" (q)).
+        depth = 0
+        for (i = length(label); i >= 1; i--) {
+            c = substr(label, i, 1)
+            if (c == ")") {
+                depth++
+            } else if (c == "(" && --depth == 0) {
+                break
+            }
+        }
+        if (i < 1) {
+            next
+        }
+        expected = substr(label, i + 1, length(label) - i - 1)
+    } else {
+        next
+    }
+
+    checked++
+    if (expected != actual) {
+        printf "%s:%d: expected \"%s\", got \"%s\"\n", FILENAME, FNR, expected, actual
+        failed++
+    }
+}
+
+END {
+    if (!checked) {
+        printf "%s: nothing was checked\n", FILENAME
+        exit 1
+    }
+    if (failed) {
+        printf "%d of %d checks failed\n", failed, checked
+        exit 1
+    }
+}
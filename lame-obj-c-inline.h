@@ -0,0 +1,167 @@
+/**
+ *  lame-obj-c-inline.h
+ *  lame-obj-c
+ *
+ *  Object layouts and inline versions of the calls that end up in tight
+ *  loops, for code that can't afford a function call per cell.
+ *
+ *  The Fast accessors check they were handed the right kind of object and
+ *  abort otherwise, same as the regular ones. Define NDEBUG or
+ *  LAME_UNCHECKED to compile the checks out, after which passing them the
+ *  wrong kind of object (or nil, apart from RetainFast and ReleaseFast) is
+ *  undefined. The object header still gets read either way, see
+ *  _CheckKindFast.
+ */
+
+#ifndef LAME_OBJ_C_INLINE_H
+#define LAME_OBJ_C_INLINE_H
+
+#include <stdlib.h>
+
+#include "lame-obj-c.h"
+
+#if !defined(NDEBUG) && !defined(LAME_UNCHECKED)
+#define LAME_CHECKED 1
+#else
+#define LAME_CHECKED 0
+#endif
+
+#pragma mark Object Layout
+
+static const ObjectType ObjectTypeIdentifier = 0;
+static const ObjectType ConsTypeIdentifier = 1;
+static const ObjectType AutoReleasePoolTypeIdentifier = 2;
+static const ObjectType CharTypeIdentifier = 3;
+static const ObjectType StringTypeIdentifier = 4;
+static const ObjectType StringViewTypeIdentifier = 5;
+
+typedef struct ObjectState {
+    ObjectType kind;
+    RefCount refCount;
+    /* Registered size plus whatever payload the object was created with. */
+    size_t allocationSize;
+    DeallocFunc deallocFunc;
+    DescriptionFunc descriptionFunc;
+} ObjectState;
+
+typedef struct ConsRefState {
+    ObjectState common;
+    Object car;
+    Object cdr;
+    /* nil until the cell shows up in a Description, see the Cons section. */
+    struct DescriptionCache *description;
+} ConsRefState;
+
+typedef struct AutoReleasePoolRefState {
+    ObjectState common;
+    ConsRef *objectsToRelease;
+} AutoReleasePoolRefState;
+
+typedef struct CharRefState {
+    ObjectState common;
+    char character;
+} CharRefState;
+
+/* Strings we made ourselves keep their characters inline right after the
+ * header, NUL terminated. */
+typedef struct StringRefState {
+    ObjectState common;
+    size_t length;
+    char characters[1];
+} StringRefState;
+
+/* Strings over somebody else's memory are their own kind of object, so the
+ * ones above don't pay for these. releaseFunc gets told when we are done
+ * with bytes, and substrings hold on to the string they point into through
+ * parent. length sits where it does in StringRefState. */
+typedef struct StringViewRefState {
+    ObjectState common;
+    size_t length;
+    const char *bytes;
+    StringBytesReleaseFunc releaseFunc;
+    void *releaseContext;
+    StringRef parent;
+} StringViewRefState;
+
+/* Runs obj's dealloc func and gives its memory back. Only for once the last
+ * reference is gone. */
+void _ObjectDestroy(Object obj);
+
+#pragma mark Fast Paths
+
+static inline void _CheckKindFast(Object obj, ObjectType type) {
+#if LAME_CHECKED
+    if (!obj || ((ObjectState *)obj)->kind != type) {
+        abort();
+    }
+#else
+    /* Release builds still load the header, they just don't look at it.
+     * Measured, not explained: without this load an unchecked walk over a
+     * list that doesn't fit in L1 ran at about half the speed of the checked
+     * one (cons_traverse_fast at 1000, 3.7 vs 1.6ns per cell). The empty asm
+     * keeps the compiler from dropping the load. */
+    ObjectType kind = ((ObjectState *)obj)->kind;
+    __asm__("" : : "r" (kind));
+    (void)type;
+#endif
+}
+
+/* Both kinds of string pass. */
+static inline void _CheckStringFast(Object obj) {
+#if LAME_CHECKED
+    if (!obj || (((ObjectState *)obj)->kind != StringTypeIdentifier &&
+                 ((ObjectState *)obj)->kind != StringViewTypeIdentifier)) {
+        abort();
+    }
+#else
+    /* Only reads the header when unchecked. */
+    _CheckKindFast(obj, StringTypeIdentifier);
+#endif
+}
+
+/* Where a string's characters are, whichever kind it is. */
+static inline const char *_StringBytes(Object string) {
+    if (((ObjectState *)string)->kind == StringViewTypeIdentifier) {
+        return ((StringViewRefState *)string)->bytes;
+    }
+    return ((StringRefState *)string)->characters;
+}
+
+static inline void RetainFast(Object obj) {
+    if (obj) {
+        __atomic_add_fetch(&((ObjectState *)obj)->refCount, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static inline void ReleaseFast(Object obj) {
+    if (obj && __atomic_sub_fetch(&((ObjectState *)obj)->refCount, 1, __ATOMIC_ACQ_REL) == 0) {
+        _ObjectDestroy(obj);
+    }
+}
+
+static inline Object ConsCarFast(ConsRef cons) {
+    _CheckKindFast(cons, ConsTypeIdentifier);
+    return ((ConsRefState *)cons)->car;
+}
+
+static inline Object ConsCdrFast(ConsRef cons) {
+    _CheckKindFast(cons, ConsTypeIdentifier);
+    return ((ConsRefState *)cons)->cdr;
+}
+
+static inline char CharCCharFast(CharRef character) {
+    _CheckKindFast(character, CharTypeIdentifier);
+    return ((CharRefState *)character)->character;
+}
+
+static inline const char *StringBytesFast(StringRef string) {
+    _CheckStringFast(string);
+    return _StringBytes(string);
+}
+
+static inline size_t StringLengthFast(StringRef string) {
+    _CheckStringFast(string);
+    return ((StringRefState *)string)->length;
+}
+
+#endif
@@ -6,55 +6,146 @@
  *  Copyright (c) 2012 Daniel Drzimotta. All rights reserved.
  */
 
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#include "lame-obj-c.h"
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "lame-obj-c-inline.h"
 
 #pragma mark Base Object System
 
-static ConsRef _autoReleasePools = nil;
+/* Every thread gets its own stack of pools. */
+static __thread ConsRef _autoReleasePools = nil;
 static ssize_t *registeredTypes = NULL;
-
-static const ObjectTypeIdentifier = 0;
-static const ConsTypeIdentifier = 1;
-static const AutoReleasePoolTypeIdentifier = 2;
-static const CharTypeIdentifier = 3;
-static const StringTypeIdentifier = 4;
+static ObjectAllocator _allocator = { NULL, NULL, NULL, NULL };
 
 void _AutoReleasePoolRegister(Object obj);
+void _StringKernelSetup();
 ConsRef _ConsPop(ConsRef cons, Object *obj, BOOL shouldAutoRelease);
 ConsRef _ConsPush(ConsRef cons, Object obj, BOOL shouldAutoRelease);
 ObjectType _Kind(Object obj);
+StringRef _StringCreateWithBytes(const char *bytes, size_t length);
+ConsRef _ConsCreateTaking(Object car, Object cdr);
+void _ConsCountCreated(size_t count);
+
+#pragma mark Allocators
+
+void *_DefaultAlloc(size_t size, void *context) {
+    return malloc(size);
+}
+
+void *_DefaultZeroAlloc(size_t size, void *context) {
+    return calloc(1, size);
+}
+
+void _DefaultFree(void *ptr, size_t sizeHint, void *context) {
+    free(ptr);
+}
+
+ObjectAllocator DefaultAllocator() {
+    ObjectAllocator allocator = { &_DefaultAlloc, &_DefaultZeroAlloc, &_DefaultFree, NULL };
+    return allocator;
+}
+
+/* Keeps everything max_align_t aligned without needing C11. */
+static const size_t kBumpAllocatorAlignment = 16;
+
+void *_BumpAlloc(size_t size, void *context) {
+    BumpAllocatorContext *bump = (BumpAllocatorContext*)context;
+    /* The buffer itself might not be aligned, so it's the address that gets
+     * rounded up, not the offset. */
+    uintptr_t address = (uintptr_t)(bump->buffer + bump->offset);
+    size_t padding = (size_t)(-address & (kBumpAllocatorAlignment - 1));
+    size_t start = bump->offset + padding;
+    if (padding > bump->capacity - bump->offset || size > bump->capacity - start) {
+        printf("Bump allocator out of memory (%lu of %lu bytes used).\n",
+               (unsigned long)bump->offset, (unsigned long)bump->capacity);
+        abort();
+    }
+    bump->offset = start + size;
+    return bump->buffer + start;
+}
+
+void *_BumpZeroAlloc(size_t size, void *context) {
+    void *ptr = _BumpAlloc(size, context);
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+void _BumpFree(void *ptr, size_t sizeHint, void *context) {
+    /* Nothing to do... */
+}
+
+ObjectAllocator BumpAllocatorMake(BumpAllocatorContext *context, void *buffer, size_t capacity) {
+    ObjectAllocator allocator = { &_BumpAlloc, &_BumpZeroAlloc, &_BumpFree, context };
+    context->buffer = buffer;
+    context->capacity = capacity;
+    context->offset = 0;
+    return allocator;
+}
+
+void BumpAllocatorReset(BumpAllocatorContext *context) {
+    context->offset = 0;
+}
+
+void *_CountingAlloc(size_t size, void *context) {
+    CountingAllocatorContext *counting = (CountingAllocatorContext*)context;
+    __atomic_add_fetch(&counting->allocations, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&counting->bytesAllocated, size, __ATOMIC_RELAXED);
+    return counting->backing.alloc(size, counting->backing.context);
+}
+
+void *_CountingZeroAlloc(size_t size, void *context) {
+    CountingAllocatorContext *counting = (CountingAllocatorContext*)context;
+    __atomic_add_fetch(&counting->allocations, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&counting->bytesAllocated, size, __ATOMIC_RELAXED);
+    return counting->backing.zeroAlloc(size, counting->backing.context);
+}
+
+void _CountingFree(void *ptr, size_t sizeHint, void *context) {
+    CountingAllocatorContext *counting = (CountingAllocatorContext*)context;
+    if (ptr) {
+        __atomic_add_fetch(&counting->frees, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&counting->bytesFreed, sizeHint, __ATOMIC_RELAXED);
+    }
+    counting->backing.free(ptr, sizeHint, counting->backing.context);
+}
 
-typedef struct ObjectState {
-    ObjectType kind;
-    RefCount refCount;
-    DeallocFunc deallocFunc;
-    DescriptionFunc descriptionFunc;
-} ObjectState;
-
-typedef struct ConsRefState {
-    ObjectState common;
-    Object car;
-    Object cdr;
-} ConsRefState;
-
-typedef struct AutoReleasePoolRefState {
-    ObjectState common;
-    ConsRef *objectsToRelease;
-} AutoReleasePoolRefState;
-
-typedef struct CharRefState {
-    ObjectState common;
-    char character;
-} CharRefState;
-
-typedef struct StringRefState {
-    ObjectState common;
-    ConsRef consRep;
-} StringRefState;
+ObjectAllocator CountingAllocatorMake(CountingAllocatorContext *context, ObjectAllocator backing) {
+    ObjectAllocator allocator = { &_CountingAlloc, &_CountingZeroAlloc, &_CountingFree, context };
+    memset(context, 0, sizeof(CountingAllocatorContext));
+    context->backing = backing;
+    return allocator;
+}
+
+ObjectAllocator ObjectSystemAllocator() {
+    return _allocator;
+}
+
+void *_Alloc(size_t size) {
+    return _allocator.alloc(size, _allocator.context);
+}
+
+void *_ZeroAlloc(size_t size) {
+    return _allocator.zeroAlloc(size, _allocator.context);
+}
+
+void _Free(void *ptr, size_t sizeHint) {
+    _allocator.free(ptr, sizeHint, _allocator.context);
+}
 
 #pragma mark Utility
 
@@ -82,29 +173,50 @@ ssize_t RegisteredObjectSize(ObjectType type) {
 }
 
 void SetupObjectSystem() {
-    registeredTypes = calloc(1, kTypesOfObjectsAllowed);
+    SetupObjectSystemWithAllocator(DefaultAllocator());
+}
+
+void SetupObjectSystemWithAllocator(ObjectAllocator allocator) {
+    _allocator = allocator;
+    if (registeredTypes) {
+        return;
+    }
+    /* Only the first time, so switching allocators keeps a kernel somebody
+     * picked with StringKernelSelect. */
+    _StringKernelSetup();
+    registeredTypes = calloc(kTypesOfObjectsAllowed, sizeof(ssize_t));
     RegisterObjectType(ObjectTypeIdentifier, sizeof(ObjectState));
     RegisterObjectType(ConsTypeIdentifier, sizeof(ConsRefState));
     RegisterObjectType(AutoReleasePoolTypeIdentifier, sizeof(AutoReleasePoolRefState));
     RegisterObjectType(CharTypeIdentifier, sizeof(CharRefState));
-    RegisterObjectType(StringTypeIdentifier, sizeof(StringRefState));
+    RegisterObjectType(StringTypeIdentifier, offsetof(StringRefState, characters));
+    RegisterObjectType(StringViewTypeIdentifier, sizeof(StringViewRefState));
 }
 
-Object _ObjectInitialize(ObjectType type, DeallocFunc deallocFunc, DescriptionFunc descriptionFunc) {
+/* payloadSize extra bytes are tacked onto the end of the registered size so
+ * variable length data can live in the same allocation as the object. */
+Object _ObjectInitializeWithPayload(ObjectType type, size_t payloadSize, DeallocFunc deallocFunc, DescriptionFunc descriptionFunc) {
     
-    Object obj = calloc(1, RegisteredObjectSize(type));
-    ObjectState *common = (ObjectState*)obj;
-    common->kind = type;
-    common->deallocFunc = deallocFunc;
-    common->descriptionFunc = descriptionFunc;
-    Retain(obj);
+    size_t allocationSize = RegisteredObjectSize(type) + payloadSize;
+    Object obj = _ZeroAlloc(allocationSize);
     if (!obj) {
         printf("ERROR Creating obj.\n");
         abort();
     }
+    ObjectState *common = (ObjectState*)obj;
+    common->kind = type;
+    common->allocationSize = allocationSize;
+    common->deallocFunc = deallocFunc;
+    common->descriptionFunc = descriptionFunc;
+    /* Nobody else can see it yet so no need for Retain's atomics. */
+    common->refCount = 1;
     return obj;
 }
 
+Object _ObjectInitialize(ObjectType type, DeallocFunc deallocFunc, DescriptionFunc descriptionFunc) {
+    return _ObjectInitializeWithPayload(type, 0, deallocFunc, descriptionFunc);
+}
+
 ObjectType _Kind(Object obj) {
     if (obj) {
         ObjectState *common = (ObjectState*)obj;
@@ -130,10 +242,10 @@ void _AutoReleasePoolDealloc(Object obj) {
 }
 
 StringRef _AutoReleasePoolDescription(Object obj) {
-    char *description = calloc(1, 100);
+    char *description = _ZeroAlloc(100);
     sprintf(description, "Autorelease pool: %p", obj);
     StringRef stringToReturn = StringCreate(description);
-    free(description);
+    _Free(description, 100);
     return AutoRelease(stringToReturn);
 }
 
@@ -145,10 +257,9 @@ void _AutoReleasePoolRegister(Object obj) {
         printf("AutoReleasing with no pool in place. Leaking memory.\n");
         return;
     }
-    ConsRef oldObjectsToRelease = currentPool->objectsToRelease;
-    currentPool->objectsToRelease = _ConsPush(currentPool->objectsToRelease, obj, NO);
-    Release(oldObjectsToRelease);
-    Release(obj);
+    /* The pool takes over the caller's reference. */
+    currentPool->objectsToRelease = _ConsCreateTaking(obj, currentPool->objectsToRelease);
+    _ConsCountCreated(1);
 }
 
 void AutoReleasePoolCreate() {
@@ -177,29 +288,40 @@ void AutoReleasePoolDrain() {
 
 #pragma mark Memory
 
+/* Reference counts are atomic so objects can be shared between threads.
+ * Releases need acquire/release ordering so whoever deallocs sees every
+ * write made through the other references. */
+
 void Retain(Object obj) {
     if (obj) {
         ObjectState *common = (ObjectState *)obj;
-        common->refCount += 1;
+        __atomic_add_fetch(&common->refCount, 1, __ATOMIC_RELAXED);
     }
 }
 
 RefCount RetainCount(Object obj) {
     if (obj) {
         ObjectState *common = (ObjectState *)obj;
-        return common->refCount;
+        return __atomic_load_n(&common->refCount, __ATOMIC_RELAXED);
     }
     return 0;
 }
 
+/* YES if that was the last reference and obj needs to go. */
+BOOL _ReleaseReference(Object obj) {
+    ObjectState *common = (ObjectState *)obj;
+    return __atomic_sub_fetch(&common->refCount, 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+void _ObjectDestroy(Object obj) {
+    ObjectState *common = (ObjectState *)obj;
+    common->deallocFunc(obj);
+    _Free(obj, common->allocationSize);
+}
+
 void Release(Object obj) {
-    if (obj) {
-        ObjectState *common = (ObjectState *)obj;
-        common->refCount -= 1;
-        if (common->refCount == 0) {
-            common->deallocFunc(obj);
-            free(obj);
-        }
+    if (obj && _ReleaseReference(obj)) {
+        _ObjectDestroy(obj);
     }
 }
 
@@ -211,12 +333,71 @@ Object AutoRelease(Object obj) {
     return obj;
 }
 
+/* How many of the same object start at objects. */
+size_t _ObjectRun(Object *objects, size_t count) {
+    size_t run = 1;
+    while (run < count && objects[run] == objects[0]) {
+        run++;
+    }
+    return run;
+}
+
+void RetainMany(Object *objects, size_t count) {
+    size_t i = 0;
+    while (i < count) {
+        size_t run = _ObjectRun(objects + i, count - i);
+        if (objects[i]) {
+            ObjectState *common = (ObjectState *)objects[i];
+            __atomic_add_fetch(&common->refCount, run, __ATOMIC_RELAXED);
+        }
+        i += run;
+    }
+}
+
+void ReleaseMany(Object *objects, size_t count) {
+    size_t i = 0;
+    while (i < count) {
+        size_t run = _ObjectRun(objects + i, count - i);
+        if (objects[i]) {
+            ObjectState *common = (ObjectState *)objects[i];
+            if (__atomic_sub_fetch(&common->refCount, run, __ATOMIC_ACQ_REL) == 0) {
+                _ObjectDestroy(objects[i]);
+            }
+        }
+        i += run;
+    }
+}
+
+/* Like AutoRelease for each, but the pool's cells go on without any
+ * reference counting at all. */
+void AutoReleaseMany(Object *objects, size_t count) {
+    AutoReleasePoolRefState *currentPool = ConsCar(_autoReleasePools);
+    size_t made = 0;
+    size_t i = 0;
+    
+    if (!currentPool) {
+        printf("AutoReleasing with no pool in place. Leaking memory.\n");
+        return;
+    }
+    
+    ConsRef objectsToRelease = currentPool->objectsToRelease;
+    for (i = 0; i < count; i++) {
+        if (objects[i]) {
+            objectsToRelease = _ConsCreateTaking(objects[i], objectsToRelease);
+            made++;
+        }
+    }
+    currentPool->objectsToRelease = objectsToRelease;
+    _ConsCountCreated(made);
+}
+
 StringRef Description(Object obj) {
-    char *notFound = "Description method not found.";
-    StringRef notFoundRef = AutoRelease(StringCreate(notFound));
     if (obj) {
         ObjectState *common = (ObjectState *)obj;
-        return common->descriptionFunc ? common->descriptionFunc(obj) : notFoundRef;
+        if (common->descriptionFunc) {
+            return common->descriptionFunc(obj);
+        }
+        return AutoRelease(StringCreate("Description method not found."));
     } else {
         return nil;
     }
@@ -228,101 +409,314 @@ static unsigned int _consMade = 0;
 static unsigned int _consDealloced = 0;
 
 unsigned int numberOfConsCreated() {
-    return _consMade;
+    return __atomic_load_n(&_consMade, __ATOMIC_RELAXED);
 }
 unsigned int numberOfLeakedCons() {
-    return _consMade - _consDealloced;
+    return numberOfConsCreated() - __atomic_load_n(&_consDealloced, __ATOMIC_RELAXED);
 }
 
-void _ConsDealloc(Object obj) {
-    _consDealloced++;
-    
-    ConsRefState *cons = (ConsRefState *)obj;
-    ConsSetCar(cons, nil);
-    ConsSetCdr(cons, nil);
+/* Descriptions of cons graphs get cached on the cell they were asked of, as
+ * long as everything in them is a cons, string, char or nil (anything else
+ * might describe itself differently next time). Every cell a description
+ * walked through gets marked, and changing a marked cell bumps
+ * _descriptionEpoch, which throws out every cached description at once.
+ * Entries are capped at kDescriptionCacheBudget bytes, counting the whole
+ * string object and the DescriptionCache, not just the text. A stale entry
+ * only gives its bytes back once its cell gets described again or goes away.
+ * _descriptionCacheLock guards the entries and the count. */
+typedef struct DescriptionCache {
+    StringRef string;
+    unsigned long epoch;
+    /* What this entry was charged against the budget. */
+    size_t size;
+} DescriptionCache;
+
+static const size_t kDescriptionCacheBudget = 8 * 1024 * 1024;
+/* Marks cells that were described without anything getting cached. */
+static DescriptionCache _describedUncached = { nil, 0, 0 };
+static unsigned long _descriptionEpoch = 1;
+static size_t _descriptionCacheBytes = 0;
+static pthread_mutex_t _descriptionCacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct DescriptionBuffer {
+    char *bytes;
+    size_t length;
+    size_t capacity;
+    /* NO once something went in that can't be cached. */
+    BOOL cacheable;
+} DescriptionBuffer;
+
+/* Call before changing a cell in place. */
+void _ConsWillChange(ConsRefState *cons) {
+    if (__atomic_load_n(&cons->description, __ATOMIC_RELAXED)) {
+        __atomic_add_fetch(&_descriptionEpoch, 1, __ATOMIC_RELAXED);
+    }
 }
 
-StringRef _ConsDescriptionWithOpeningPar(Object obj, BOOL openingPar) {
-    ConsRef *cons = obj;
-    
-    if (_Kind(obj) != ConsTypeIdentifier) {
-            return AutoRelease(Description(cons));
+void _ConsMarkDescribed(ConsRefState *cons) {
+    DescriptionCache *expected = nil;
+    __atomic_compare_exchange_n(&cons->description, &expected, &_describedUncached, NO, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/* What caching length bytes of text would cost, see _StringAllocate. */
+size_t _DescriptionCacheSize(size_t length) {
+    return sizeof(DescriptionCache) + RegisteredObjectSize(StringTypeIdentifier) + length + 1;
+}
+
+/* For entries that are already off the budget. */
+void _DescriptionCacheRelease(DescriptionCache *cache) {
+    if (cache && cache != &_describedUncached) {
+        Release(cache->string);
+        _Free(cache, sizeof(DescriptionCache));
     }
-    
-    
-    if (!ConsCar(cons) && !ConsCdr(cons)) {
-        return AutoRelease(StringCreate("()"));
+}
+
+void _DescriptionCacheFree(DescriptionCache *cache) {
+    if (cache && cache != &_describedUncached) {
+        pthread_mutex_lock(&_descriptionCacheLock);
+        _descriptionCacheBytes -= cache->size;
+        pthread_mutex_unlock(&_descriptionCacheLock);
+        _DescriptionCacheRelease(cache);
     }
+}
+
+/* The cached description of cons, retained, or nil. */
+StringRef _ConsCachedDescription(ConsRefState *cons) {
+    StringRef string = nil;
     
-    Object carVal = ConsCar(cons) ?: AutoRelease(StringCreate("NIL"));
-    Object cdrVal = ConsCdr(cons);
-    
-    StringRef openingParString = openingPar ? StringCreate("(%s") : StringCreate(" %s");
+    if (!__atomic_load_n(&cons->description, __ATOMIC_RELAXED)) {
+        return nil;
+    }
+    pthread_mutex_lock(&_descriptionCacheLock);
+    DescriptionCache *cache = cons->description;
+    if (cache->string && cache->epoch == __atomic_load_n(&_descriptionEpoch, __ATOMIC_RELAXED)) {
+        string = cache->string;
+        Retain(string);
+    }
+    pthread_mutex_unlock(&_descriptionCacheLock);
+    return string;
+}
+
+/* epoch is from before the description was made, so a change that raced
+ * with making it leaves the cache already stale. Whatever cons had cached
+ * before is out of date by now, so it comes off the budget before checking
+ * whether the new text fits, and the text only gets copied once it does. */
+void _ConsCacheDescription(ConsRefState *cons, const char *bytes, size_t length, unsigned long epoch) {
+    size_t size = _DescriptionCacheSize(length);
     
-    if (ConsCdr(cons)) {
-        StringConcatenate(openingParString, AutoRelease(StringCreate(" ")));
+    pthread_mutex_lock(&_descriptionCacheLock);
+    DescriptionCache *oldCache = __atomic_exchange_n(&cons->description, &_describedUncached, __ATOMIC_RELAXED);
+    if (oldCache != &_describedUncached && oldCache) {
+        _descriptionCacheBytes -= oldCache->size;
     }
+    BOOL fits = _descriptionCacheBytes + size <= kDescriptionCacheBudget;
+    if (fits) {
+        _descriptionCacheBytes += size;
+    }
+    pthread_mutex_unlock(&_descriptionCacheLock);
+    _DescriptionCacheRelease(oldCache);
     
-    StringRef carDescription = Description(carVal);
+    if (!fits) {
+        return;
+    }
+    DescriptionCache *cache = _Alloc(sizeof(DescriptionCache));
+    cache->string = _StringCreateWithBytes(bytes, length);
+    cache->epoch = epoch;
+    cache->size = size;
     
-    if (ConsCar(cons) && _Kind(carVal) == StringTypeIdentifier) {
-        carDescription = StringSPrint(carDescription, "\"%s\"");
+    /* Somebody else might have cached it in the meantime. */
+    pthread_mutex_lock(&_descriptionCacheLock);
+    oldCache = __atomic_exchange_n(&cons->description, cache, __ATOMIC_RELAXED);
+    if (oldCache != &_describedUncached && oldCache) {
+        _descriptionCacheBytes -= oldCache->size;
+    }
+    pthread_mutex_unlock(&_descriptionCacheLock);
+    _DescriptionCacheRelease(oldCache);
+}
+
+/* Zero length appends can come with NULL bytes (empty strings made with
+ * StringCreateNoCopy), and the buffer starts out NULL, so neither gets
+ * handed to memcpy. */
+void _DescriptionAppend(DescriptionBuffer *buffer, const char *bytes, size_t length) {
+    if (length == 0) {
+        return;
+    }
+    if (buffer->length + length > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity * 2 : 64;
+        while (capacity < buffer->length + length) {
+            capacity *= 2;
+        }
+        char *newBytes = _Alloc(capacity);
+        if (buffer->length) {
+            memcpy(newBytes, buffer->bytes, buffer->length);
+        }
+        _Free(buffer->bytes, buffer->capacity);
+        buffer->bytes = newBytes;
+        buffer->capacity = capacity;
     }
+    memcpy(buffer->bytes + buffer->length, bytes, length);
+    buffer->length += length;
+}
+
+void _ConsDescribeInto(DescriptionBuffer *buffer, ConsRefState *cons);
+
+/* Strings get quoted. */
+void _DescriptionAppendObject(DescriptionBuffer *buffer, Object obj) {
+    ObjectType kind = _Kind(obj);
     
-    char *fetchedCString =   StringCString(carDescription);
-    char *fetchedParString = StringCString(Description(openingParString));
-    char *aCar = calloc(1, (fetchedCString ? strlen(fetchedCString) : 0) + (fetchedParString ? strlen(fetchedParString) : 0));
-    sprintf(aCar, fetchedParString, fetchedCString);
-    free(fetchedCString);
-    free(fetchedParString);
+    if (kind == ConsTypeIdentifier) {
+        _ConsDescribeInto(buffer, obj);
+    } else if (kind == StringTypeIdentifier || kind == StringViewTypeIdentifier) {
+        _DescriptionAppend(buffer, "\"", 1);
+        _DescriptionAppend(buffer, StringBytes(obj), StringLength(obj));
+        _DescriptionAppend(buffer, "\"", 1);
+    } else if (kind == CharTypeIdentifier) {
+        char character = CharCChar(obj);
+        _DescriptionAppend(buffer, &character, 1);
+    } else {
+        StringRef description = Description(obj);
+        if (description) {
+            _DescriptionAppend(buffer, StringBytes(description), StringLength(description));
+        } else {
+            _DescriptionAppend(buffer, "(null)", 6);
+        }
+        buffer->cacheable = NO;
+    }
+}
+
+/* (a b c), (a b . c), with NIL for nil cars. A cell with nil for both car
+ * and cdr comes out as () wherever it is. */
+void _ConsDescribeInto(DescriptionBuffer *buffer, ConsRefState *cons) {
+    StringRef cached = _ConsCachedDescription(cons);
+    if (cached) {
+        _DescriptionAppend(buffer, StringBytes(cached), StringLength(cached));
+        Release(cached);
+        return;
+    }
     
-    char *aCdr = NULL;
+    unsigned long epoch = __atomic_load_n(&_descriptionEpoch, __ATOMIC_RELAXED);
+    BOOL outerCacheable = buffer->cacheable;
+    size_t start = buffer->length;
+    ConsRefState *cell = cons;
+    BOOL first = YES;
     
-    if (cdrVal) {
+    buffer->cacheable = YES;
+    for (;;) {
+        _ConsMarkDescribed(cell);
         
-        if (_Kind(cdrVal) == ConsTypeIdentifier) {
-            char *fetchedCString = StringCString(_ConsDescriptionWithOpeningPar(cdrVal, NO));
-            aCdr = fetchedCString;
-        } else {
-            
-            StringRef cdrDescription = _ConsDescriptionWithOpeningPar(cdrVal, NO);
-            
-            if (_Kind(cdrVal) == StringTypeIdentifier) {
-                cdrDescription = StringSPrint(cdrDescription, "\"%s\"");
-            }
-            
-            StringRef catted = StringConcatenate(AutoRelease(StringCreate(" . ")), cdrDescription);
-            catted = StringConcatenate(catted, AutoRelease(StringCreate(")")));
-            aCdr = StringCString(catted);
+        if (!cell->car && !cell->cdr) {
+            _DescriptionAppend(buffer, "()", 2);
+            break;
         }
         
+        _DescriptionAppend(buffer, first ? "(" : " ", 1);
+        if (cell->car) {
+            _DescriptionAppendObject(buffer, cell->car);
+        } else {
+            _DescriptionAppend(buffer, "NIL", 3);
+        }
         
-    } else {
-        aCdr = calloc(1, strlen(")"));
-        sprintf(aCdr, "%s", ")");
+        if (!cell->cdr) {
+            _DescriptionAppend(buffer, ")", 1);
+            break;
+        }
+        if (_Kind(cell->cdr) != ConsTypeIdentifier) {
+            _DescriptionAppend(buffer, " . ", 3);
+            _DescriptionAppendObject(buffer, cell->cdr);
+            _DescriptionAppend(buffer, ")", 1);
+            break;
+        }
+        cell = cell->cdr;
+        first = NO;
     }
     
-    char *returnString = calloc(1, 1 + strlen(aCar) + strlen(aCdr));
-    sprintf(returnString, "%s%s", aCar, aCdr);
+    /* Lists sitting in cars end up with entries of their own too. */
+    if (buffer->cacheable) {
+        _ConsCacheDescription(cons, buffer->bytes + start, buffer->length - start, epoch);
+    }
+    buffer->cacheable = outerCacheable && buffer->cacheable;
+}
+
+/* Lets go of the car and hands back the cdr, which the caller now owns. */
+Object _ConsTearDown(ConsRefState *cons) {
+    __atomic_add_fetch(&_consDealloced, 1, __ATOMIC_RELAXED);
     
-    Release(openingParString);
-    free(aCar);
-    free(aCdr);
+    /* Nobody can see this cell any more, so no need to bump the epoch. */
+    _DescriptionCacheFree(cons->description);
+    cons->description = nil;
     
-    StringRef rVal = AutoRelease(StringCreate(returnString));
+    Object car = cons->car;
+    cons->car = nil;
+    Release(car);
+    Object cdr = cons->cdr;
+    cons->cdr = nil;
+    return cdr;
+}
+
+void _ConsDealloc(Object obj) {
+    Object next = _ConsTearDown((ConsRefState *)obj);
     
+    /* Free the rest of the list here one cell at a time. Letting Release do it
+     * recurses once per cell, which runs out of stack on long lists. */
+    while (_Kind(next) == ConsTypeIdentifier) {
+        if (!_ReleaseReference(next)) {
+            return;
+        }
+        ConsRefState *cons = (ConsRefState *)next;
+        next = _ConsTearDown(cons);
+        _Free(cons, cons->common.allocationSize);
+    }
+    Release(next);
+}
+
+StringRef _ConsDescription(Object obj) {
+    StringRef cached = _ConsCachedDescription(obj);
+    if (cached) {
+        return AutoRelease(cached);
+    }
     
-    free(returnString);
+    DescriptionBuffer buffer = { NULL, 0, 0, YES };
+    _ConsDescribeInto(&buffer, obj);
     
-    return rVal;
+    /* That just cached it if it could. */
+    cached = _ConsCachedDescription(obj);
+    if (!cached) {
+        cached = _StringCreateWithBytes(buffer.bytes, buffer.length);
+    }
+    _Free(buffer.bytes, buffer.capacity);
+    return AutoRelease(cached);
 }
 
-StringRef _ConsDescription(Object obj) {
-    return _ConsDescriptionWithOpeningPar(obj, YES);
+void _ConsCountCreated(size_t count) {
+    __atomic_add_fetch(&_consMade, count, __ATOMIC_RELAXED);
+}
+
+/* A cell that takes over the caller's references to car and cdr instead of
+ * retaining them. Leaves counting it to the caller, see _ConsCountCreated. */
+ConsRef _ConsCreateTaking(Object car, Object cdr) {
+    ConsRefState *newCons = _ObjectInitialize(ConsTypeIdentifier, &_ConsDealloc, &_ConsDescription);
+    newCons->car = car;
+    newCons->cdr = cdr;
+    return newCons;
+}
+
+/* Back to front, so every cell's reference goes straight to the one before
+ * it and the cars get retained in one go. */
+ConsRef ConsCreateFromArray(Object *objects, size_t count) {
+    ConsRef list = nil;
+    size_t i = count;
+    
+    RetainMany(objects, count);
+    while (i > 0) {
+        i--;
+        list = _ConsCreateTaking(objects[i], list);
+    }
+    _ConsCountCreated(count);
+    return list;
 }
 
 ConsRef ConsCreate(Object car, Object cdr) {
-    _consMade++;
+    __atomic_add_fetch(&_consMade, 1, __ATOMIC_RELAXED);
     
     ConsRef newCons = _ObjectInitialize(ConsTypeIdentifier, &_ConsDealloc, &_ConsDescription);
     ConsSetCar(newCons, car);
@@ -337,6 +731,7 @@ Object ConsCar(ConsRef cons) {
 }
 
 void ConsSetCar(ConsRef cons, Object obj) {
+    _ConsWillChange(cons);
     Object prvObj = ((ConsRefState*)cons)->car;
     ((ConsRefState*)cons)->car = obj;
     Retain(obj);
@@ -350,6 +745,7 @@ Object ConsCdr(ConsRef cons) {
 }
 
 void ConsSetCdr(ConsRef cons, Object obj) {
+    _ConsWillChange(cons);
     Object prvObj = ((ConsRefState*)cons)->cdr;
     ((ConsRefState*)cons)->cdr = obj;
     Retain(obj);
@@ -357,35 +753,45 @@ void ConsSetCdr(ConsRef cons, Object obj) {
 }
 
 
+/* Lists are copy on write, so a copy is just another reference. Anything
+ * that changes cells in place checks nobody else can see them first. */
 ConsRef ConsCopy(ConsRef cons) {
-    if (_Kind(cons) == ConsTypeIdentifier) {
-        ConsRef consToCopyTo = cons ? ConsCreate(nil, nil) : nil;
-        
-        if (!consToCopyTo) {
-            return nil;
-        }
-        
-        Object carToMoveOver = ConsCar(cons);
-        Object cdrToCopy = ConsCdr(cons);
-        
-        if (_Kind(cdrToCopy) != ConsTypeIdentifier && cdrToCopy) {
-            abort();
-        }
-        
-        ConsSetCar(consToCopyTo, carToMoveOver);
-        ConsRef cdrCopy = ConsCopy(cdrToCopy);
-        ConsSetCdr(consToCopyTo, cdrCopy);
-        Release(cdrCopy);
-        
-        return consToCopyTo;
-    } else {
+    if (cons) {
+        _abortIfMismatch(cons, ConsTypeIdentifier);
+    }
+    Retain(cons);
+    return cons;
+}
 
-        if (cons) {
-            abort();
+/* Fresh cells for all of cons with end hung off the last one. Returns the
+ * first of them, which the caller owns. */
+ConsRef _ConsCopySpine(ConsRef cons, Object end) {
+    ConsRefState head;
+    ConsRefState *tail = &head;
+    
+    /* Each cell's reference from ConsCreate goes to the one before it. */
+    for (; cons; cons = ConsCdr(cons)) {
+        ConsRefState *copy = ConsCreate(ConsCar(cons), nil);
+        tail->cdr = copy;
+        tail = copy;
+    }
+    tail->cdr = end;
+    Retain(end);
+    
+    return head.cdr;
+}
+
+/* A cell with more than one reference can be reached by someone else, and so
+ * can everything after it. Hands back cons if nothing is shared, otherwise an
+ * autoreleased copy. */
+ConsRef _ConsUnshared(ConsRef cons) {
+    ConsRef cell = cons;
+    for (; _Kind(cell) == ConsTypeIdentifier; cell = ((ConsRefState *)cell)->cdr) {
+        if (RetainCount(cell) > 1) {
+            return AutoRelease(_ConsCopySpine(cons, nil));
         }
-        
-        return cons;
     }
+    return cons;
 }
 
 ConsRef ConsPush(ConsRef cons, Object obj) {
@@ -393,11 +799,7 @@ ConsRef ConsPush(ConsRef cons, Object obj) {
 }
 
 ConsRef _ConsPush(ConsRef cons, Object obj, BOOL shouldAutoRelease) {
-    ConsRef consCopy = ConsCopy(cons);
-    
-    ConsRef consOnTop = ConsCreate(obj, consCopy);
-    
-    Release(consCopy);
+    ConsRef consOnTop = ConsCreate(obj, cons);
     
     if (shouldAutoRelease) {
         AutoRelease(consOnTop);
@@ -427,25 +829,46 @@ ConsRef _ConsPop(ConsRef cons, Object *obj, BOOL shouldAutoRelease) {
 }
 
 ConsRef ConsAddToEnd(ConsRef cons, Object obj) {
-    ConsRef consToReturn = nil;
     if (cons == nil) {
-        consToReturn = AutoRelease(ConsCreate(obj, nil));
-    } else if (!ConsCdr(cons)){
-        ConsRef newCarCons = ConsCreate(obj, nil);
-        ConsSetCdr(cons, newCarCons);
-        Release(newCarCons);
-        consToReturn = cons;
+        return AutoRelease(ConsCreate(obj, nil));
+    }
+    _abortIfMismatch(cons, ConsTypeIdentifier);
+    
+    ConsRef end = ConsCreate(obj, nil);
+    ConsRef consToReturn = cons;
+    
+    if (RetainCount(cons) > 1) {
+        /* Someone else holds the whole thing, leave it be. */
+        consToReturn = AutoRelease(_ConsCopySpine(cons, end));
     } else {
-        ConsRef cdr = ConsCdr(cons);
-        ConsAddToEnd(cdr, obj);
-        consToReturn = cons;
+        /* Walk as far as the cells are only ours, then copy whatever is left
+         * so the end can go on without anyone else seeing it. */
+        ConsRef last = cons;
+        ConsRef next = ConsCdr(last);
+        while (next && RetainCount(next) == 1) {
+            last = next;
+            next = ConsCdr(next);
+        }
+        
+        if (next) {
+            ConsRef copy = _ConsCopySpine(next, end);
+            ConsSetCdr(last, copy);
+            Release(copy);
+        } else {
+            ConsSetCdr(last, end);
+        }
     }
     
+    Release(end);
     return consToReturn;
 }
 
 int ConsLength(ConsRef cons) {
-    return cons ? 1 + ConsLength(ConsCdr(cons)) : 0;
+    int length = 0;
+    for (; cons; cons = ConsCdr(cons)) {
+        length++;
+    }
+    return length;
 }
 
 
@@ -453,10 +876,10 @@ int ConsLength(ConsRef cons) {
 
 StringRef _CharDescription (Object obj) {
     CharRefState *state = (CharRefState*)obj;
-    char *stringRep = calloc(1, 2);
+    char *stringRep = _ZeroAlloc(2);
     sprintf(stringRep, "%c", state->character);
     StringRef stringToReturn = StringCreate(stringRep);
-    free(stringRep);
+    _Free(stringRep, 2);
     return AutoRelease(stringToReturn);
 }
 
@@ -480,134 +903,1251 @@ char CharCChar(CharRef obj) {
     }
 }
 
-#pragma mark String
-
-StringRef _StringDescription (Object obj) {
-    StringRefState *string = (StringRefState*)obj;
-    char *stringCString = StringCString(string);
-    StringRef stringToReturn = AutoRelease(StringCreate(stringCString));
-    free(stringCString);
-    return stringToReturn;
+#pragma mark String Kernels
+
+typedef struct StringKernels {
+    BOOL (*equal)(const char *bytesZero, const char *bytesOne, size_t length);
+    long (*find)(const char *haystack, size_t haystackLength, const char *needle, size_t needleLength);
+    unsigned int (*hash)(const char *bytes, size_t length);
+} StringKernels;
+
+/* The hash runs 8 lanes of 32 bits over 32 byte blocks so the SIMD versions
+ * can do a whole block per step and still agree with the scalar one. */
+static const uint32_t kHashLaneSeed = 0x811C9DC5u;
+static const uint32_t kHashLanePrime = 0x9E3779B1u;
+static const uint32_t kHashFoldPrime = 0x01000193u;
+static const int kHashLanes = 8;
+static const int kHashRotate = 13;
+
+uint32_t _HashFinish(const uint32_t *lanes, const unsigned char *tail, size_t tailLength, size_t length) {
+    uint32_t hash = kHashLaneSeed ^ (uint32_t)length;
+    int i = 0;
+    
+    for (i = 0; i < kHashLanes; i++) {
+        hash = (hash ^ lanes[i]) * kHashFoldPrime;
+    }
+    for (i = 0; i < tailLength; i++) {
+        hash = (hash ^ tail[i]) * kHashFoldPrime;
+    }
+    
+    hash ^= hash >> 16;
+    hash *= 0x85EBCA6Bu;
+    hash ^= hash >> 13;
+    hash *= 0xC2B2AE35u;
+    hash ^= hash >> 16;
+    return hash;
 }
 
-void _StringDealloc(Object obj) {
-    StringRefState *string = (StringRefState*)obj;
-    Release(string->consRep);
-    string->consRep = nil;
+void _HashSeedLanes(uint32_t *lanes) {
+    int i = 0;
+    for (i = 0; i < kHashLanes; i++) {
+        lanes[i] = kHashLaneSeed + (uint32_t)i * kHashLanePrime;
+    }
 }
 
-StringRef StringCreate(char *string) {
-    StringRefState *newString = _ObjectInitialize(StringTypeIdentifier, &_StringDealloc, &_StringDescription);
-    newString->consRep = nil;
-
-    if (string) {
-        int i = 0;
-        do {
-            CharRef *translatedChar = CharCreate(string[i]);
-            newString->consRep = ConsAddToEnd(newString->consRep, translatedChar);
-            Release(translatedChar);
-            i++;
-        } while (string[i] != '\0');
+BOOL _StringEqualScalar(const char *bytesZero, const char *bytesOne, size_t length) {
+    size_t i = 0;
+    
+    for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+        uint64_t wordZero;
+        uint64_t wordOne;
+        memcpy(&wordZero, bytesZero + i, sizeof(uint64_t));
+        memcpy(&wordOne, bytesOne + i, sizeof(uint64_t));
+        if (wordZero != wordOne) {
+            return NO;
+        }
     }
-
-    Retain(newString->consRep);
-
-    return newString;
+    for (; i < length; i++) {
+        if (bytesZero[i] != bytesOne[i]) {
+            return NO;
+        }
+    }
+    return YES;
 }
 
-char *StringCString(StringRef obj) {
-  int i = 0;
-    if (!obj) {
-        return NULL;
+long _StringFindScalar(const char *haystack, size_t haystackLength, const char *needle, size_t needleLength) {
+    size_t i = 0;
+    
+    if (needleLength == 0) {
+        return 0;
+    }
+    if (needleLength > haystackLength) {
+        return -1;
     }
     
-    StringRefState *string = (StringRefState*)obj;
-    unsigned int length = StringLength(string);
-    char *cString = calloc(1, length + 1);
-    ConsRef *stringCons = string->consRep;
-    for (i = 0; i < length; i++) {
-        cString[i] = CharCChar(((CharRef*)ConsCar(stringCons)));
-        stringCons = ConsCdr(stringCons);
-    }
-    cString[length] = '\0';
-    return cString;
-}
-
-void _StringSetConsRep(StringRefState *state, ConsRef consRep) {
-    Release(state->consRep);
-    state->consRep = consRep;
-    Retain(state->consRep);
+    for (i = 0; i <= haystackLength - needleLength; i++) {
+        if (haystack[i] == needle[0] && _StringEqualScalar(haystack + i, needle, needleLength)) {
+            return i;
+        }
+    }
+    return -1;
 }
 
-unsigned int StringLength(StringRef obj) {
-    StringRefState *string = (StringRefState*)obj;
-    return ConsLength(string->consRep);
+unsigned int _StringHashScalar(const char *bytes, size_t length) {
+    const unsigned char *data = (const unsigned char *)bytes;
+    uint32_t lanes[8];
+    size_t i = 0;
+    int lane = 0;
+    
+    _HashSeedLanes(lanes);
+    
+    for (; i + 32 <= length; i += 32) {
+        for (lane = 0; lane < kHashLanes; lane++) {
+            const unsigned char *word = data + i + lane * 4;
+            uint32_t value = (uint32_t)word[0] | ((uint32_t)word[1] << 8) | ((uint32_t)word[2] << 16) | ((uint32_t)word[3] << 24);
+            uint32_t mixed = (lanes[lane] ^ value) * kHashLanePrime;
+            lanes[lane] = (mixed << kHashRotate) | (mixed >> (32 - kHashRotate));
+        }
+    }
+    
+    return _HashFinish(lanes, data + i, length - i, length);
 }
 
-BOOL StringEqual(StringRef stringZero, StringRef stringOne) {
-  int i = 0;
-
-    StringRefState *stringZeroState = (StringRefState*)stringZero;
-    StringRefState *stringOneState = (StringRefState*)stringOne;
+static const StringKernels kScalarKernels = { &_StringEqualScalar, &_StringFindScalar, &_StringHashScalar };
 
-    unsigned int lengthZero = StringLength(stringZero);
-    unsigned int lengthOne = StringLength(stringOne);
-
-    if (lengthOne != lengthZero) {
-        return NO;
-    }
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
 
-    ConsRef *stringConsZero = stringZeroState->consRep;
-    ConsRef *stringConsOne = stringOneState->consRep;
-    for (i = 0; i < lengthZero; i++) {
-        char charZero = CharCChar(((CharRef*)ConsCar(stringConsZero)));
-        char charOne = CharCChar(((CharRef*)ConsCar(stringConsOne)));
+#define LAME_HAVE_X86_KERNELS 1
 
-        if (charZero != charOne) {
+__attribute__((target("sse2")))
+BOOL _StringEqualSSE2(const char *bytesZero, const char *bytesOne, size_t length) {
+    size_t i = 0;
+    
+    for (; i + 16 <= length; i += 16) {
+        __m128i blockZero = _mm_loadu_si128((const __m128i *)(bytesZero + i));
+        __m128i blockOne = _mm_loadu_si128((const __m128i *)(bytesOne + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(blockZero, blockOne)) != 0xFFFF) {
             return NO;
         }
-
-        stringConsZero = ConsCdr(stringConsZero);
-        stringConsOne = ConsCdr(stringConsOne);
     }
-
-    return YES;
+    return _StringEqualScalar(bytesZero + i, bytesOne + i, length - i);
 }
 
-StringRef StringConcatenate(StringRef string, StringRef stringToAdd) {
-    char *origString = StringCString(string);
-    char *newString = StringCString(stringToAdd);
-    StringRef stringToReturn = StringCreate(origString);
-    StringRefState *stringToReturnState = (StringRefState*)stringToReturn;
-    
-        int i = 0;
-        do {
-            CharRef *translatedChar = CharCreate(newString[i]);
-            stringToReturnState->consRep = ConsAddToEnd(stringToReturnState->consRep, translatedChar);
-            Release(translatedChar);
-            i++;
-        } while (newString[i] != '\0');
-    
-    free(origString);
-    free(newString);
+/* Only candidates whose first and last characters both match get compared in full. */
+__attribute__((target("sse2")))
+long _StringFindSSE2(const char *haystack, size_t haystackLength, const char *needle, size_t needleLength) {
+    size_t i = 0;
     
-    return AutoRelease(stringToReturn);
+    if (needleLength == 0) {
+        return 0;
+    }
+    if (needleLength > haystackLength) {
+        return -1;
+    }
+    
+    __m128i first = _mm_set1_epi8(needle[0]);
+    __m128i last = _mm_set1_epi8(needle[needleLength - 1]);
+    
+    for (; i + needleLength - 1 + 16 <= haystackLength; i += 16) {
+        __m128i blockFirst = _mm_loadu_si128((const __m128i *)(haystack + i));
+        __m128i blockLast = _mm_loadu_si128((const __m128i *)(haystack + i + needleLength - 1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, blockFirst),
+                                                            _mm_cmpeq_epi8(last, blockLast)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (_StringEqualSSE2(haystack + i + bit, needle, needleLength)) {
+                return i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    
+    long rest = _StringFindScalar(haystack + i, haystackLength - i, needle, needleLength);
+    return rest < 0 ? -1 : (long)i + rest;
+}
+
+/* SSE2 has no 32 bit multiply that keeps the low halves, so build one. */
+__attribute__((target("sse2")))
+static inline __m128i _mm_mullo_epi32_sse2(__m128i a, __m128i b) {
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i _HashLaneStepSSE2(__m128i lanes, __m128i words, __m128i prime) {
+    __m128i mixed = _mm_mullo_epi32_sse2(_mm_xor_si128(lanes, words), prime);
+    return _mm_or_si128(_mm_slli_epi32(mixed, kHashRotate), _mm_srli_epi32(mixed, 32 - kHashRotate));
+}
+
+__attribute__((target("sse2")))
+unsigned int _StringHashSSE2(const char *bytes, size_t length) {
+    uint32_t lanes[8];
+    size_t i = 0;
+    
+    _HashSeedLanes(lanes);
+    __m128i lanesLow = _mm_loadu_si128((const __m128i *)lanes);
+    __m128i lanesHigh = _mm_loadu_si128((const __m128i *)(lanes + 4));
+    __m128i prime = _mm_set1_epi32((int)kHashLanePrime);
+    
+    for (; i + 32 <= length; i += 32) {
+        lanesLow = _HashLaneStepSSE2(lanesLow, _mm_loadu_si128((const __m128i *)(bytes + i)), prime);
+        lanesHigh = _HashLaneStepSSE2(lanesHigh, _mm_loadu_si128((const __m128i *)(bytes + i + 16)), prime);
+    }
+    
+    _mm_storeu_si128((__m128i *)lanes, lanesLow);
+    _mm_storeu_si128((__m128i *)(lanes + 4), lanesHigh);
+    return _HashFinish(lanes, (const unsigned char *)bytes + i, length - i, length);
+}
+
+__attribute__((target("avx2")))
+BOOL _StringEqualAVX2(const char *bytesZero, const char *bytesOne, size_t length) {
+    size_t i = 0;
+    
+    for (; i + 32 <= length; i += 32) {
+        __m256i blockZero = _mm256_loadu_si256((const __m256i *)(bytesZero + i));
+        __m256i blockOne = _mm256_loadu_si256((const __m256i *)(bytesOne + i));
+        if ((unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(blockZero, blockOne)) != 0xFFFFFFFFu) {
+            return NO;
+        }
+    }
+    return _StringEqualScalar(bytesZero + i, bytesOne + i, length - i);
+}
+
+__attribute__((target("avx2")))
+long _StringFindAVX2(const char *haystack, size_t haystackLength, const char *needle, size_t needleLength) {
+    size_t i = 0;
+    
+    if (needleLength == 0) {
+        return 0;
+    }
+    if (needleLength > haystackLength) {
+        return -1;
+    }
+    
+    __m256i first = _mm256_set1_epi8(needle[0]);
+    __m256i last = _mm256_set1_epi8(needle[needleLength - 1]);
+    
+    for (; i + needleLength - 1 + 32 <= haystackLength; i += 32) {
+        __m256i blockFirst = _mm256_loadu_si256((const __m256i *)(haystack + i));
+        __m256i blockLast = _mm256_loadu_si256((const __m256i *)(haystack + i + needleLength - 1));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first, blockFirst),
+                                                                  _mm256_cmpeq_epi8(last, blockLast)));
+        while (mask) {
+            int bit = __builtin_ctz(mask);
+            if (_StringEqualAVX2(haystack + i + bit, needle, needleLength)) {
+                return i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    
+    for (; i <= haystackLength - needleLength; i++) {
+        if (haystack[i] == needle[0] && _StringEqualAVX2(haystack + i, needle, needleLength)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+__attribute__((target("avx2")))
+unsigned int _StringHashAVX2(const char *bytes, size_t length) {
+    uint32_t lanes[8];
+    size_t i = 0;
+    
+    _HashSeedLanes(lanes);
+    __m256i lanesVector = _mm256_loadu_si256((const __m256i *)lanes);
+    __m256i prime = _mm256_set1_epi32((int)kHashLanePrime);
+    
+    for (; i + 32 <= length; i += 32) {
+        __m256i words = _mm256_loadu_si256((const __m256i *)(bytes + i));
+        __m256i mixed = _mm256_mullo_epi32(_mm256_xor_si256(lanesVector, words), prime);
+        lanesVector = _mm256_or_si256(_mm256_slli_epi32(mixed, kHashRotate), _mm256_srli_epi32(mixed, 32 - kHashRotate));
+    }
+    
+    _mm256_storeu_si256((__m256i *)lanes, lanesVector);
+    return _HashFinish(lanes, (const unsigned char *)bytes + i, length - i, length);
+}
+
+static const StringKernels kSSE2Kernels = { &_StringEqualSSE2, &_StringFindSSE2, &_StringHashSSE2 };
+static const StringKernels kAVX2Kernels = { &_StringEqualAVX2, &_StringFindAVX2, &_StringHashAVX2 };
+
+#endif
+
+static const StringKernels *_stringKernels = &kScalarKernels;
+static StringKernel _stringKernel = StringKernelScalar;
+
+BOOL _StringKernelSupported(StringKernel kernel) {
+    switch (kernel) {
+        case StringKernelScalar:
+            return YES;
+#ifdef LAME_HAVE_X86_KERNELS
+        case StringKernelSSE2:
+            return __builtin_cpu_supports("sse2") ? YES : NO;
+        case StringKernelAVX2:
+            return __builtin_cpu_supports("avx2") ? YES : NO;
+#endif
+        default:
+            return NO;
+    }
+}
+
+StringKernel StringKernelActive() {
+    return _stringKernel;
+}
+
+BOOL StringKernelSelect(StringKernel kernel) {
+    if (!_StringKernelSupported(kernel)) {
+        return NO;
+    }
+    
+    switch (kernel) {
+#ifdef LAME_HAVE_X86_KERNELS
+        case StringKernelSSE2:
+            _stringKernels = &kSSE2Kernels;
+            break;
+        case StringKernelAVX2:
+            _stringKernels = &kAVX2Kernels;
+            break;
+#endif
+        default:
+            _stringKernels = &kScalarKernels;
+            break;
+    }
+    _stringKernel = kernel;
+    return YES;
+}
+
+void _StringKernelSetup() {
+    if (!StringKernelSelect(StringKernelAVX2) && !StringKernelSelect(StringKernelSSE2)) {
+        StringKernelSelect(StringKernelScalar);
+    }
+}
+
+#pragma mark String
+
+
+/* Strings never change, so they can stand for themselves. */
+StringRef _StringDescription (Object obj) {
+    Retain(obj);
+    return AutoRelease(obj);
+}
+
+void _StringDealloc(Object obj) {
+    /* Nothing to do... */
+}
+
+void _StringViewDealloc(Object obj) {
+    StringViewRefState *view = (StringViewRefState*)obj;
+    if (view->releaseFunc) {
+        view->releaseFunc(view->bytes, view->length, view->releaseContext);
+    }
+    Release(view->parent);
+    view->parent = nil;
+}
+
+/* Leaves the characters zeroed, length + 1 of them so there is always a NUL on the end. */
+StringRefState *_StringAllocate(size_t length) {
+    StringRefState *newString = _ObjectInitializeWithPayload(StringTypeIdentifier, length + 1, &_StringDealloc, &_StringDescription);
+    newString->length = length;
+    return newString;
+}
+
+StringRef _StringCreateWithBytes(const char *bytes, size_t length) {
+    StringRefState *newString = _StringAllocate(length);
+    if (length) {
+        memcpy(newString->characters, bytes, length);
+    }
+    return newString;
+}
+
+StringRef StringCreate(char *string) {
+    return _StringCreateWithBytes(string, string ? strlen(string) : 0);
+}
+
+StringRef StringCreateNoCopy(const char *bytes, size_t length, StringBytesReleaseFunc releaseFunc, void *context) {
+    StringViewRefState *newString = _ObjectInitialize(StringViewTypeIdentifier, &_StringViewDealloc, &_StringDescription);
+    newString->length = length;
+    newString->bytes = bytes;
+    newString->releaseFunc = releaseFunc;
+    newString->releaseContext = context;
+    return newString;
+}
+
+StringRef StringCreateSubstring(StringRef obj, size_t location, size_t length) {
+    StringRefState *string = (StringRefState*)obj;
+    if (location > string->length || length > string->length - location) {
+        printf("Substring (%lu, %lu) is out of bounds of a string with length %lu.\n",
+               (unsigned long)location, (unsigned long)length, (unsigned long)string->length);
+        abort();
+    }
+    
+    /* Point at whoever actually owns the bytes so views of views don't chain. */
+    StringRef owner = string;
+    if (string->common.kind == StringViewTypeIdentifier && ((StringViewRefState*)string)->parent) {
+        owner = ((StringViewRefState*)string)->parent;
+    }
+    
+    StringViewRefState *newString = StringCreateNoCopy(_StringBytes(string) + location, length, NULL, NULL);
+    newString->parent = owner;
+    Retain(owner);
+    return newString;
+}
+
+/* The buffer's capacity rides along in context, that's the size it was
+ * allocated with. */
+void _StringFreeFileBytes(const char *bytes, size_t length, void *context) {
+    _Free((void *)bytes, (size_t)(uintptr_t)context);
+}
+
+/* Reads file to the end into one buffer and closes it. sizeHint is how big
+ * we think it is, 0 if we have no idea. */
+StringRef _StringCreateFromStream(FILE *file, size_t sizeHint) {
+    size_t capacity = 0;
+    size_t length = 0;
+    char *bytes = NULL;
+    
+    for (;;) {
+        if (length == capacity) {
+            size_t newCapacity = capacity ? capacity * 2 : (sizeHint ? sizeHint + 1 : 4096);
+            char *newBytes = _Alloc(newCapacity);
+            if (!newBytes) {
+                _Free(bytes, capacity);
+                fclose(file);
+                return nil;
+            }
+            if (length) {
+                memcpy(newBytes, bytes, length);
+            }
+            _Free(bytes, capacity);
+            bytes = newBytes;
+            capacity = newCapacity;
+        }
+        
+        size_t wanted = capacity - length;
+        size_t got = fread(bytes + length, 1, wanted, file);
+        length += got;
+        if (got < wanted) {
+            break;
+        }
+    }
+    
+    BOOL failed = ferror(file) ? YES : NO;
+    fclose(file);
+    if (failed || length == 0) {
+        _Free(bytes, capacity);
+        return failed ? nil : StringCreate(NULL);
+    }
+    
+    return StringCreateNoCopy(bytes, length, &_StringFreeFileBytes, (void *)(uintptr_t)capacity);
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+
+void _StringUnmapFile(const char *bytes, size_t length, void *context) {
+    munmap((void *)bytes, length);
+}
+
+StringRef StringCreateFromFile(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return nil;
+    }
+    
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return nil;
+    }
+    
+    /* Pipes and devices have no size to map, and files in /proc say they
+     * are empty when they aren't, so those get read instead. */
+    size_t length = (size_t)info.st_size;
+    if (!S_ISREG(info.st_mode) || length == 0) {
+        FILE *file = fdopen(fd, "rb");
+        if (!file) {
+            close(fd);
+            return nil;
+        }
+        return _StringCreateFromStream(file, 0);
+    }
+    
+    void *bytes = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (bytes == MAP_FAILED) {
+        return nil;
+    }
+    madvise(bytes, length, MADV_SEQUENTIAL);
+    
+    return StringCreateNoCopy(bytes, length, &_StringUnmapFile, NULL);
+}
+
+#else
+
+/* No mmap here so read the whole thing in. Still only the one copy when
+ * the file can tell us how big it is. */
+StringRef StringCreateFromFile(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return nil;
+    }
+    
+    long length = -1;
+    if (fseek(file, 0, SEEK_END) == 0) {
+        length = ftell(file);
+        fseek(file, 0, SEEK_SET);
+    }
+    
+    return _StringCreateFromStream(file, length > 0 ? (size_t)length : 0);
+}
+
+#endif
+
+const char *StringBytes(StringRef obj) {
+    return _StringBytes(obj);
+}
+
+char *StringCString(StringRef obj) {
+    if (!obj) {
+        return NULL;
+    }
+    
+    StringRefState *string = (StringRefState*)obj;
+    char *cString = calloc(1, string->length + 1);
+    memcpy(cString, _StringBytes(string), string->length);
+    return cString;
+}
+
+/* StringCString for our own use, out of our allocator. Goes back with
+ * _Free(cString, *size). */
+char *_StringScratchCString(StringRef obj, size_t *size) {
+    *size = 0;
+    if (!obj) {
+        return NULL;
+    }
+    
+    StringRefState *string = (StringRefState*)obj;
+    *size = string->length + 1;
+    char *cString = _Alloc(*size);
+    memcpy(cString, _StringBytes(string), string->length);
+    cString[string->length] = '\0';
+    return cString;
+}
+
+size_t StringLength(StringRef obj) {
+    StringRefState *string = (StringRefState*)obj;
+    return string->length;
+}
+
+BOOL StringEqual(StringRef stringZero, StringRef stringOne) {
+    StringRefState *stringZeroState = (StringRefState*)stringZero;
+    StringRefState *stringOneState = (StringRefState*)stringOne;
+
+    if (stringZeroState == stringOneState) {
+        return YES;
+    }
+    if (stringZeroState->length != stringOneState->length) {
+        return NO;
+    }
+
+    return _stringKernels->equal(_StringBytes(stringZeroState), _StringBytes(stringOneState), stringZeroState->length);
+}
+
+BOOL StringHasPrefix(StringRef string, StringRef prefix) {
+    StringRefState *stringState = (StringRefState*)string;
+    StringRefState *prefixState = (StringRefState*)prefix;
+    
+    if (prefixState->length > stringState->length) {
+        return NO;
+    }
+    
+    return _stringKernels->equal(_StringBytes(stringState), _StringBytes(prefixState), prefixState->length);
+}
+
+long StringFind(StringRef string, StringRef needle) {
+    StringRefState *stringState = (StringRefState*)string;
+    StringRefState *needleState = (StringRefState*)needle;
+    
+    return _stringKernels->find(_StringBytes(stringState), stringState->length,
+                                _StringBytes(needleState), needleState->length);
+}
+
+unsigned int StringHash(StringRef string) {
+    StringRefState *stringState = (StringRefState*)string;
+    return _stringKernels->hash(_StringBytes(stringState), stringState->length);
+}
+
+StringRef StringConcatenate(StringRef string, StringRef stringToAdd) {
+    StringRefState *stringState = (StringRefState*)string;
+    StringRefState *stringToAddState = (StringRefState*)stringToAdd;
+    
+    StringRefState *stringToReturn = _StringAllocate(stringState->length + stringToAddState->length);
+    memcpy(stringToReturn->characters, _StringBytes(stringState), stringState->length);
+    memcpy(stringToReturn->characters + stringState->length, _StringBytes(stringToAddState), stringToAddState->length);
+    
+    return AutoRelease(stringToReturn);
 }
 
 void StringPrint(Object obj, const char *format) {
     StringRef objDescription = Description(obj);
-    char *cRep = StringCString(objDescription);
+    size_t cRepSize = 0;
+    char *cRep = _StringScratchCString(objDescription, &cRepSize);
     printf(format, cRep);
-    free(cRep);
+    _Free(cRep, cRepSize);
 }
 
 StringRef StringSPrint(Object obj, const char *format) {
     StringRef objDescription = Description(obj);
-    char *cRep = StringCString(objDescription);
-    char *sprint = calloc(1, strlen(cRep) + strlen(format));
+    size_t cRepSize = 0;
+    char *cRep = _StringScratchCString(objDescription, &cRepSize);
+    size_t sprintSize = strlen(cRep) + strlen(format);
+    char *sprint = _ZeroAlloc(sprintSize);
     sprintf(sprint, format, cRep);
     StringRef toReturn = AutoRelease(StringCreate(sprint));
-    free(cRep);
-    free(sprint);
+    _Free(cRep, cRepSize);
+    _Free(sprint, sprintSize);
     return toReturn;
 }
+
+#pragma mark Iterators
+
+BOOL _ConsIteratorNext(Iterator *iterator) {
+    ConsRef cons = iterator->source;
+    if (_Kind(cons) != ConsTypeIdentifier) {
+        return NO;
+    }
+    
+    iterator->object = ConsCarFast(cons);
+    iterator->source = ConsCdrFast(cons);
+    return YES;
+}
+
+BOOL _StringIteratorNext(Iterator *iterator) {
+    if (iterator->index >= iterator->count) {
+        return NO;
+    }
+    
+    iterator->character = iterator->bytes[iterator->index++];
+    return YES;
+}
+
+BOOL _NilIteratorNext(Iterator *iterator) {
+    return NO;
+}
+
+void IteratorInitWithNext(Iterator *iterator, IteratorNextFunc next, Object source) {
+    memset(iterator, 0, sizeof(Iterator));
+    iterator->next = next;
+    iterator->source = source;
+}
+
+void IteratorInit(Iterator *iterator, Object collection) {
+    ObjectType kind = _Kind(collection);
+    
+    if (!collection) {
+        IteratorInitWithNext(iterator, &_NilIteratorNext, nil);
+    } else if (kind == ConsTypeIdentifier) {
+        IteratorInitWithNext(iterator, &_ConsIteratorNext, collection);
+    } else if (kind == StringTypeIdentifier || kind == StringViewTypeIdentifier) {
+        IteratorInitWithNext(iterator, &_StringIteratorNext, collection);
+        iterator->bytes = StringBytes(collection);
+        iterator->count = StringLength(collection);
+    } else {
+        printf("Objects of type (%i) can't be iterated.\n", kind);
+        abort();
+    }
+}
+
+BOOL IteratorNext(Iterator *iterator) {
+    return iterator->next(iterator);
+}
+
+BOOL _IteratorPull(Iterator *iterator) {
+    Iterator *upstream = iterator->upstream;
+    if (!upstream->next(upstream)) {
+        return NO;
+    }
+    
+    iterator->object = upstream->object;
+    iterator->character = upstream->character;
+    return YES;
+}
+
+BOOL _MapIteratorNext(Iterator *iterator) {
+    if (!_IteratorPull(iterator)) {
+        return NO;
+    }
+    
+    iterator->mapFunc(iterator, iterator->context);
+    return YES;
+}
+
+BOOL _FilterIteratorNext(Iterator *iterator) {
+    while (_IteratorPull(iterator)) {
+        if (iterator->filterFunc(iterator, iterator->context)) {
+            return YES;
+        }
+    }
+    return NO;
+}
+
+BOOL _TakeIteratorNext(Iterator *iterator) {
+    if (iterator->index >= iterator->count) {
+        return NO;
+    }
+    
+    iterator->index++;
+    return _IteratorPull(iterator);
+}
+
+void IteratorMap(Iterator *iterator, Iterator *upstream, IteratorMapFunc map, void *context) {
+    IteratorInitWithNext(iterator, &_MapIteratorNext, nil);
+    iterator->upstream = upstream;
+    iterator->mapFunc = map;
+    iterator->context = context;
+}
+
+void IteratorFilter(Iterator *iterator, Iterator *upstream, IteratorFilterFunc filter, void *context) {
+    IteratorInitWithNext(iterator, &_FilterIteratorNext, nil);
+    iterator->upstream = upstream;
+    iterator->filterFunc = filter;
+    iterator->context = context;
+}
+
+void IteratorTake(Iterator *iterator, Iterator *upstream, size_t count) {
+    IteratorInitWithNext(iterator, &_TakeIteratorNext, nil);
+    iterator->upstream = upstream;
+    iterator->count = count;
+}
+
+#pragma mark Thread Pool
+
+typedef void(*TaskFunc)(void *argument);
+
+typedef struct TaskGroup {
+    int remaining;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+} TaskGroup;
+
+typedef struct Task {
+    TaskFunc func;
+    void *argument;
+    TaskGroup *group;
+} Task;
+
+/* A ring of tasks. The owning worker takes from the bottom, thieves take
+ * from the top so they grab the oldest (and usually biggest) work. */
+typedef struct WorkerQueue {
+    pthread_mutex_t lock;
+    Task *tasks;
+    size_t capacity;
+    size_t top;
+    size_t count;
+} WorkerQueue;
+
+typedef struct Worker {
+    ThreadPool *pool;
+    int index;
+    pthread_t thread;
+} Worker;
+
+struct ThreadPool {
+    int workerCount;
+    Worker *workers;
+    WorkerQueue *queues;
+    
+    /* Guards everything below. Idle workers sleep on wake. */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    long queuedTasks;
+    int nextQueue;
+    BOOL stopping;
+};
+
+void _WorkerQueuePush(WorkerQueue *queue, Task task) {
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count == queue->capacity) {
+        size_t newCapacity = queue->capacity ? queue->capacity * 2 : 16;
+        Task *newTasks = _Alloc(newCapacity * sizeof(Task));
+        size_t i = 0;
+        for (i = 0; i < queue->count; i++) {
+            newTasks[i] = queue->tasks[(queue->top + i) % queue->capacity];
+        }
+        _Free(queue->tasks, queue->capacity * sizeof(Task));
+        queue->tasks = newTasks;
+        queue->capacity = newCapacity;
+        queue->top = 0;
+    }
+    queue->tasks[(queue->top + queue->count) % queue->capacity] = task;
+    queue->count++;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+BOOL _WorkerQueueTake(WorkerQueue *queue, Task *task, BOOL fromTop) {
+    BOOL found = NO;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count) {
+        if (fromTop) {
+            *task = queue->tasks[queue->top];
+            queue->top = (queue->top + 1) % queue->capacity;
+        } else {
+            *task = queue->tasks[(queue->top + queue->count - 1) % queue->capacity];
+        }
+        queue->count--;
+        found = YES;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+BOOL _WorkerFindTask(Worker *worker, Task *task) {
+    ThreadPool *pool = worker->pool;
+    BOOL found = _WorkerQueueTake(&pool->queues[worker->index], task, NO);
+    int i = 0;
+    
+    for (i = 1; !found && i < pool->workerCount; i++) {
+        found = _WorkerQueueTake(&pool->queues[(worker->index + i) % pool->workerCount], task, YES);
+    }
+    
+    if (found) {
+        pthread_mutex_lock(&pool->lock);
+        pool->queuedTasks--;
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return found;
+}
+
+void *_WorkerMain(void *argument) {
+    Worker *worker = (Worker *)argument;
+    ThreadPool *pool = worker->pool;
+    Task task;
+    
+    for (;;) {
+        if (_WorkerFindTask(worker, &task)) {
+            AutoReleasePoolCreate();
+            task.func(task.argument);
+            AutoReleasePoolDrain();
+            
+            pthread_mutex_lock(&task.group->lock);
+            if (--task.group->remaining == 0) {
+                pthread_cond_broadcast(&task.group->done);
+            }
+            pthread_mutex_unlock(&task.group->lock);
+            continue;
+        }
+        
+        pthread_mutex_lock(&pool->lock);
+        while (pool->queuedTasks <= 0 && !pool->stopping) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        BOOL shouldStop = pool->stopping && pool->queuedTasks <= 0;
+        pthread_mutex_unlock(&pool->lock);
+        
+        if (shouldStop) {
+            return NULL;
+        }
+    }
+}
+
+ThreadPool *ThreadPoolCreate(int workerCount) {
+    if (workerCount <= 0) {
+        workerCount = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (workerCount <= 0) {
+        workerCount = 1;
+    }
+    
+    ThreadPool *pool = _ZeroAlloc(sizeof(ThreadPool));
+    pool->workerCount = workerCount;
+    pool->workers = _ZeroAlloc(workerCount * sizeof(Worker));
+    pool->queues = _ZeroAlloc(workerCount * sizeof(WorkerQueue));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    
+    int i = 0;
+    for (i = 0; i < workerCount; i++) {
+        pthread_mutex_init(&pool->queues[i].lock, NULL);
+    }
+    for (i = 0; i < workerCount; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        if (pthread_create(&pool->workers[i].thread, NULL, &_WorkerMain, &pool->workers[i]) != 0) {
+            printf("ERROR Creating worker thread.\n");
+            abort();
+        }
+    }
+    
+    return pool;
+}
+
+void ThreadPoolDestroy(ThreadPool *pool) {
+    int i = 0;
+    
+    if (!pool) {
+        return;
+    }
+    
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = YES;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    
+    for (i = 0; i < pool->workerCount; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    for (i = 0; i < pool->workerCount; i++) {
+        pthread_mutex_destroy(&pool->queues[i].lock);
+        _Free(pool->queues[i].tasks, pool->queues[i].capacity * sizeof(Task));
+    }
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    _Free(pool->queues, pool->workerCount * sizeof(WorkerQueue));
+    _Free(pool->workers, pool->workerCount * sizeof(Worker));
+    _Free(pool, sizeof(ThreadPool));
+}
+
+int ThreadPoolWorkerCount(ThreadPool *pool) {
+    return pool->workerCount;
+}
+
+/* Runs func once per argument spread across the workers and waits for all of them. */
+void _ThreadPoolRun(ThreadPool *pool, TaskFunc func, void **arguments, int count) {
+    TaskGroup group;
+    int i = 0;
+    
+    if (count == 0) {
+        return;
+    }
+    
+    group.remaining = count;
+    pthread_mutex_init(&group.lock, NULL);
+    pthread_cond_init(&group.done, NULL);
+    
+    pthread_mutex_lock(&pool->lock);
+    int firstQueue = pool->nextQueue;
+    pool->nextQueue = (firstQueue + count) % pool->workerCount;
+    pthread_mutex_unlock(&pool->lock);
+    
+    for (i = 0; i < count; i++) {
+        Task task = { func, arguments[i], &group };
+        _WorkerQueuePush(&pool->queues[(firstQueue + i) % pool->workerCount], task);
+    }
+    
+    pthread_mutex_lock(&pool->lock);
+    pool->queuedTasks += count;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    
+    pthread_mutex_lock(&group.lock);
+    while (group.remaining > 0) {
+        pthread_cond_wait(&group.done, &group.lock);
+    }
+    pthread_mutex_unlock(&group.lock);
+    
+    pthread_cond_destroy(&group.done);
+    pthread_mutex_destroy(&group.lock);
+}
+
+#pragma mark Bulk Cons Operations
+
+static const int kConsChunksPerWorker = 4;
+
+/* A run of cells out of a bigger list, plus whatever the operation on it needs. */
+typedef struct ConsChunk {
+    ConsRef start;
+    ConsRef last;
+    size_t length;
+    
+    ConsMapFunc map;
+    ConsReduceFunc reduce;
+    ConsCompareFunc compare;
+    Object initial;
+    void *context;
+    
+    /* Results. */
+    ConsRef head;
+    ConsRef tail;
+    Object result;
+    struct ConsChunk *partner;
+} ConsChunk;
+
+/* Splits cons into about kConsChunksPerWorker chunks per worker. The chunks
+ * and the pointers to them come back in one block for _ConsChunksFree(). */
+ConsChunk **_ConsChunks(ThreadPool *pool, ConsRef cons, int *chunkCount) {
+    size_t length = 0;
+    ConsRef cell = nil;
+    int i = 0;
+    
+    for (cell = cons; cell; cell = ConsCdr(cell)) {
+        length++;
+    }
+    
+    int count = pool->workerCount * kConsChunksPerWorker;
+    if (length < count) {
+        count = (int)length;
+    }
+    
+    ConsChunk **chunks = _ZeroAlloc(count * (sizeof(ConsChunk *) + sizeof(ConsChunk)));
+    ConsChunk *chunkStorage = (ConsChunk *)(chunks + count);
+    
+    cell = cons;
+    for (i = 0; i < count; i++) {
+        ConsChunk *chunk = &chunkStorage[i];
+        size_t j = 0;
+        
+        chunks[i] = chunk;
+        chunk->start = cell;
+        chunk->length = length / count + (i < length % count ? 1 : 0);
+        for (j = 0; j < chunk->length; j++) {
+            chunk->last = cell;
+            cell = ConsCdr(cell);
+        }
+    }
+    
+    *chunkCount = count;
+    return chunks;
+}
+
+void _ConsChunksFree(ConsChunk **chunks, int count) {
+    _Free(chunks, count * (sizeof(ConsChunk *) + sizeof(ConsChunk)));
+}
+
+void _ConsMapChunk(void *argument) {
+    ConsChunk *chunk = (ConsChunk *)argument;
+    ConsRef cons = chunk->start;
+    size_t i = 0;
+    
+    for (i = 0; i < chunk->length && cons; i++) {
+        ConsRef cell = ConsCreate(chunk->map(ConsCar(cons), chunk->context), nil);
+        if (chunk->tail) {
+            /* The new cell's only reference moves into the list. */
+            ((ConsRefState *)chunk->tail)->cdr = cell;
+        } else {
+            chunk->head = cell;
+        }
+        chunk->tail = cell;
+        cons = ConsCdr(cons);
+    }
+}
+
+void _ConsReduceChunk(void *argument) {
+    ConsChunk *chunk = (ConsChunk *)argument;
+    ConsRef cons = chunk->start;
+    Object accumulator = chunk->initial;
+    size_t i = 0;
+    
+    for (i = 0; i < chunk->length && cons; i++) {
+        accumulator = chunk->reduce(accumulator, ConsCar(cons), chunk->context);
+        cons = ConsCdr(cons);
+    }
+    
+    chunk->result = accumulator;
+}
+
+void _ConsReduceChunkTask(void *argument) {
+    ConsChunk *chunk = (ConsChunk *)argument;
+    _ConsReduceChunk(chunk);
+    /* Keep the result alive past the worker's autorelease pool. */
+    Retain(chunk->result);
+}
+
+ConsRefState *_ConsMergeCells(ConsRefState *cellsZero, ConsRefState *cellsOne, ConsCompareFunc compare, void *context) {
+    ConsRefState head;
+    ConsRefState *tail = &head;
+    
+    while (cellsZero && cellsOne) {
+        /* Ties go to cellsZero, which came first, to keep the sort stable. */
+        if (compare(cellsOne->car, cellsZero->car, context) < 0) {
+            tail->cdr = cellsOne;
+            tail = cellsOne;
+            cellsOne = cellsOne->cdr;
+        } else {
+            tail->cdr = cellsZero;
+            tail = cellsZero;
+            cellsZero = cellsZero->cdr;
+        }
+    }
+    tail->cdr = cellsZero ? cellsZero : cellsOne;
+    
+    return head.cdr;
+}
+
+/* Bottom up merge sort. bins[i] holds a sorted run of 2^i cells, and earlier
+ * cells always sit in higher bins so merging them first keeps it stable.
+ * Only cdr pointers move, so every cell keeps the one reference its old
+ * predecessor held on it. */
+ConsRefState *_ConsSortCells(ConsRefState *cells, ConsCompareFunc compare, void *context) {
+    ConsRefState *bins[64];
+    ConsRefState *result = nil;
+    int i = 0;
+    
+    memset(bins, 0, sizeof(bins));
+    
+    while (cells) {
+        ConsRefState *carry = cells;
+        _ConsWillChange(carry);
+        cells = cells->cdr;
+        if (cells && _Kind(cells) != ConsTypeIdentifier) {
+            printf("Can't sort a list that doesn't end in nil.\n");
+            abort();
+        }
+        carry->cdr = nil;
+        
+        for (i = 0; bins[i]; i++) {
+            carry = _ConsMergeCells(bins[i], carry, compare, context);
+            bins[i] = nil;
+        }
+        bins[i] = carry;
+    }
+    
+    for (i = 0; i < 64; i++) {
+        if (bins[i]) {
+            result = _ConsMergeCells(bins[i], result, compare, context);
+        }
+    }
+    return result;
+}
+
+void _ConsSortChunk(void *argument) {
+    ConsChunk *chunk = (ConsChunk *)argument;
+    chunk->head = _ConsSortCells(chunk->start, chunk->compare, chunk->context);
+}
+
+void _ConsMergeChunk(void *argument) {
+    ConsChunk *chunk = (ConsChunk *)argument;
+    chunk->head = _ConsMergeCells(chunk->head, chunk->partner->head, chunk->compare, chunk->context);
+}
+
+/* The old head now has a predecessor pointing at it and the new head lost
+ * its one, so move a reference across to balance things out. */
+ConsRef _ConsSortFinish(ConsRef oldHead, ConsRef newHead) {
+    if (oldHead != newHead) {
+        Retain(oldHead);
+        AutoRelease(newHead);
+    }
+    return newHead;
+}
+
+ConsRef ConsMap(ConsRef cons, ConsMapFunc map, void *context) {
+    ConsChunk chunk;
+    memset(&chunk, 0, sizeof(ConsChunk));
+    chunk.start = cons;
+    chunk.length = (size_t)-1;
+    chunk.map = map;
+    chunk.context = context;
+    
+    _ConsMapChunk(&chunk);
+    return AutoRelease(chunk.head);
+}
+
+Object ConsReduce(ConsRef cons, ConsReduceFunc reduce, Object initial, void *context) {
+    ConsChunk chunk;
+    memset(&chunk, 0, sizeof(ConsChunk));
+    chunk.start = cons;
+    chunk.length = (size_t)-1;
+    chunk.reduce = reduce;
+    chunk.initial = initial;
+    chunk.context = context;
+    
+    _ConsReduceChunk(&chunk);
+    return chunk.result;
+}
+
+ConsRef ConsSort(ConsRef cons, ConsCompareFunc compare, void *context) {
+    if (!cons) {
+        return nil;
+    }
+    _abortIfMismatch(cons, ConsTypeIdentifier);
+    
+    cons = _ConsUnshared(cons);
+    return _ConsSortFinish(cons, _ConsSortCells(cons, compare, context));
+}
+
+ConsRef ConsMapParallel(ThreadPool *pool, ConsRef cons, ConsMapFunc map, void *context) {
+    int count = 0;
+    int i = 0;
+    ConsChunk **chunks = _ConsChunks(pool, cons, &count);
+    ConsRef head = nil;
+    ConsRef tail = nil;
+    
+    for (i = 0; i < count; i++) {
+        chunks[i]->map = map;
+        chunks[i]->context = context;
+    }
+    _ThreadPoolRun(pool, &_ConsMapChunk, (void **)chunks, count);
+    
+    for (i = 0; i < count; i++) {
+        if (tail) {
+            ((ConsRefState *)tail)->cdr = chunks[i]->head;
+        } else {
+            head = chunks[i]->head;
+        }
+        tail = chunks[i]->tail;
+    }
+    
+    _ConsChunksFree(chunks, count);
+    return AutoRelease(head);
+}
+
+Object ConsReduceParallel(ThreadPool *pool, ConsRef cons, ConsReduceFunc reduce, ConsReduceFunc combine, Object initial, void *context) {
+    int count = 0;
+    int i = 0;
+    ConsChunk **chunks = _ConsChunks(pool, cons, &count);
+    Object accumulator = initial;
+    
+    for (i = 0; i < count; i++) {
+        chunks[i]->reduce = reduce;
+        chunks[i]->initial = initial;
+        chunks[i]->context = context;
+    }
+    _ThreadPoolRun(pool, &_ConsReduceChunkTask, (void **)chunks, count);
+    
+    for (i = 0; i < count; i++) {
+        accumulator = combine(accumulator, chunks[i]->result, context);
+    }
+    
+    /* The chunk results might be all that is keeping accumulator alive. */
+    Retain(accumulator);
+    for (i = 0; i < count; i++) {
+        Release(chunks[i]->result);
+    }
+    
+    _ConsChunksFree(chunks, count);
+    return AutoRelease(accumulator);
+}
+
+ConsRef ConsSortParallel(ThreadPool *pool, ConsRef cons, ConsCompareFunc compare, void *context) {
+    int count = 0;
+    int step = 0;
+    int i = 0;
+    
+    if (!cons) {
+        return nil;
+    }
+    _abortIfMismatch(cons, ConsTypeIdentifier);
+    
+    cons = _ConsUnshared(cons);
+    ConsChunk **chunks = _ConsChunks(pool, cons, &count);
+    if (count < 2) {
+        _ConsChunksFree(chunks, count);
+        return ConsSort(cons, compare, context);
+    }
+    
+    /* Cut the list apart. The reference each cut cell held on the next chunk
+     * rides along with that chunk until it is merged back in. */
+    for (i = 0; i < count; i++) {
+        ((ConsRefState *)chunks[i]->last)->cdr = nil;
+        chunks[i]->compare = compare;
+        chunks[i]->context = context;
+    }
+    _ThreadPoolRun(pool, &_ConsSortChunk, (void **)chunks, count);
+    
+    /* Merge neighbouring runs pairwise until one is left, left run first so
+     * equal elements keep their order. */
+    ConsChunk **merges = _ZeroAlloc(count * sizeof(ConsChunk *));
+    for (step = 1; step < count; step *= 2) {
+        int mergeCount = 0;
+        for (i = 0; i + step < count; i += 2 * step) {
+            chunks[i]->partner = chunks[i + step];
+            merges[mergeCount++] = chunks[i];
+        }
+        _ThreadPoolRun(pool, &_ConsMergeChunk, (void **)merges, mergeCount);
+    }
+    
+    ConsRef sorted = chunks[0]->head;
+    _Free(merges, count * sizeof(ConsChunk *));
+    _ConsChunksFree(chunks, count);
+    return _ConsSortFinish(cons, sorted);
+}
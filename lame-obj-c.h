@@ -6,6 +6,12 @@
  *  Copyright (c) 2012 Daniel Drzimotta. All rights reserved.
  */
 
+#ifndef LAME_OBJ_C_H
+#define LAME_OBJ_C_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
 #pragma mark Base Object System
 
 #define YES 1
@@ -29,7 +35,55 @@ typedef Object StringRef;
 typedef void(*DeallocFunc)(Object obj);
 typedef StringRef(*DescriptionFunc)(Object obj);
 
+#pragma mark Allocators
+
+typedef void *(*AllocFunc)(size_t size, void *context);
+typedef void *(*ZeroAllocFunc)(size_t size, void *context);
+/* sizeHint is the size the memory was requested with. */
+typedef void(*FreeFunc)(void *ptr, size_t sizeHint, void *context);
+
+typedef struct ObjectAllocator {
+    AllocFunc alloc;
+    ZeroAllocFunc zeroAlloc;
+    FreeFunc free;
+    void *context;
+} ObjectAllocator;
+
+/* Plain calloc/free. This is what SetupObjectSystem uses. */
+ObjectAllocator DefaultAllocator();
+
+/* Hands out memory from a fixed buffer. Freeing does nothing, call
+ * BumpAllocatorReset to get the whole buffer back at once. Aborts when the
+ * buffer runs out. Not safe to use from more than one thread. */
+typedef struct BumpAllocatorContext {
+    char *buffer;
+    size_t capacity;
+    size_t offset;
+} BumpAllocatorContext;
+
+ObjectAllocator BumpAllocatorMake(BumpAllocatorContext *context, void *buffer, size_t capacity);
+void BumpAllocatorReset(BumpAllocatorContext *context);
+
+/* Forwards to another allocator and keeps track of what went through it. */
+typedef struct CountingAllocatorContext {
+    ObjectAllocator backing;
+    unsigned long allocations;
+    unsigned long frees;
+    size_t bytesAllocated;
+    size_t bytesFreed;
+} CountingAllocatorContext;
+
+ObjectAllocator CountingAllocatorMake(CountingAllocatorContext *context, ObjectAllocator backing);
+
+#pragma mark Object System
+
 void SetupObjectSystem();
+/* Every object and every scratch buffer the library frees itself comes out
+ * of the given allocator. The allocator is copied, its context is not.
+ * Can be called again to switch allocators once every object made with the
+ * previous one is gone. */
+void SetupObjectSystemWithAllocator(ObjectAllocator allocator);
+ObjectAllocator ObjectSystemAllocator();
 void RegisterObjectType(ObjectType type, ssize_t objectSize);
 ssize_t RegisteredObjectSize(ObjectType type);
 
@@ -40,16 +94,30 @@ Object AutoRelease(Object obj);
 void AutoReleasePoolCreate();
 void AutoReleasePoolDrain();
 
+/* The same for count objects at once. nil entries are skipped, and runs of
+ * the same object next to each other cost one atomic update between them. */
+void RetainMany(Object *objects, size_t count);
+void ReleaseMany(Object *objects, size_t count);
+void AutoReleaseMany(Object *objects, size_t count);
+
 StringRef Description(Object obj);
 
 ConsRef ConsCreate(Object car, Object cdr);
+/* A list of the count objects in order, built in one pass. nil if count is 0. */
+ConsRef ConsCreateFromArray(Object *objects, size_t count);
 Object ConsCar(ConsRef cons);
 void ConsSetCar(ConsRef cons, Object obj);
 Object ConsCdr(ConsRef cons);
 void ConsSetCdr(ConsRef cons, Object obj);
 
+/* Lists are copy on write. Push and pop share the rest of the list rather
+ * than copying it, and ConsCopy only takes another reference. */
 ConsRef ConsPush(ConsRef cons, Object obj);
 ConsRef ConsPop(ConsRef cons, Object *obj);
+/* Adds in place when nobody else holds any of the cells on the way to the
+ * end, otherwise copies from the first shared cell on (or all of it, handing
+ * back a new list, if cons itself is shared). Either way you don't own what
+ * comes back. ConsSetCar and ConsSetCdr always change the cell in place. */
 ConsRef ConsAddToEnd(ConsRef cons, Object obj);
 ConsRef ConsCopy(ConsRef cons);
 
@@ -62,13 +130,53 @@ unsigned int numberOfLeakedCons();
 CharRef CharCreate(char character);
 char CharCChar(CharRef character);
 
+typedef void(*StringBytesReleaseFunc)(const char *bytes, size_t length, void *context);
+
 /* It will stop copying the string over if '\0' is found. */
 StringRef StringCreate(char *string);
+
+/* Wraps length bytes, NULs and all, without copying them. The bytes have to
+ * stay put and unchanged until releaseFunc (which can be NULL) gets called
+ * with them when the string is deallocated. */
+StringRef StringCreateNoCopy(const char *bytes, size_t length, StringBytesReleaseFunc releaseFunc, void *context);
+
+/* Maps the file in read-only rather than reading it. Things that can't be
+ * mapped, like pipes, devices and files in /proc, get read to the end into
+ * one buffer instead. Returns nil if the file can't be opened or read. */
+StringRef StringCreateFromFile(const char *path);
+
+/* Shares the bytes of string rather than copying them. string is kept alive
+ * for as long as the substring is. */
+StringRef StringCreateSubstring(StringRef string, size_t location, size_t length);
+
+/* The StringLength bytes backing the string. Not NUL terminated in general. */
+const char *StringBytes(StringRef string);
+
 /* You are responsible for freeing the return val */
 char * StringCString(StringRef string);
 
-unsigned int StringLength(StringRef string);
+size_t StringLength(StringRef string);
 BOOL StringEqual(StringRef stringZero, StringRef stringOne);
+BOOL StringHasPrefix(StringRef string, StringRef prefix);
+
+/* Index of the first place needle shows up in string, or -1 if it doesn't.
+ * An empty needle is found at 0. */
+long StringFind(StringRef string, StringRef needle);
+
+/* Equal strings hash the same no matter which kernel is active. */
+unsigned int StringHash(StringRef string);
+
+/* StringEqual, StringHasPrefix, StringFind and StringHash run on one of these.
+ * SetupObjectSystem picks the widest one the CPU supports. */
+typedef enum StringKernel {
+    StringKernelScalar,
+    StringKernelSSE2,
+    StringKernelAVX2
+} StringKernel;
+
+StringKernel StringKernelActive();
+/* Returns NO and changes nothing if the CPU can't run that kernel. */
+BOOL StringKernelSelect(StringKernel kernel);
 
 /* Returns a new string with the 2 strings concatenated together. */
 StringRef StringConcatenate(StringRef string, StringRef stringToAdd);
@@ -80,3 +188,86 @@ void StringPrint(Object obj, const char *format);
 /* Same as above but returns a string rather than printing it */
 StringRef StringSPrint(Object obj, const char *format);
 
+
+#pragma mark Iterators
+
+typedef struct Iterator Iterator;
+
+typedef BOOL(*IteratorNextFunc)(Iterator *iterator);
+/* Rewrites iterator->object or iterator->character in place. */
+typedef void(*IteratorMapFunc)(Iterator *iterator, void *context);
+/* Return NO to skip the current element. */
+typedef BOOL(*IteratorFilterFunc)(Iterator *iterator, void *context);
+
+/* Meant to live on the stack. Iterating allocates nothing and retains
+ * nothing: after IteratorNext returns YES the current element is in object
+ * (or character when walking a string), borrowed from whatever is being
+ * walked, which has to outlive the iterator. */
+struct Iterator {
+    IteratorNextFunc next;
+    Object object;
+    char character;
+    
+    /* The rest is for next to keep its place with. */
+    Object source;
+    const char *bytes;
+    size_t index;
+    size_t count;
+    Iterator *upstream;
+    IteratorMapFunc mapFunc;
+    IteratorFilterFunc filterFunc;
+    void *context;
+};
+
+/* Walks the cars of a cons list or the characters of a string. nil is empty. */
+void IteratorInit(Iterator *iterator, Object collection);
+/* For anything else: next gets called with source stashed in iterator->source. */
+void IteratorInitWithNext(Iterator *iterator, IteratorNextFunc next, Object source);
+BOOL IteratorNext(Iterator *iterator);
+
+/* These pull from upstream one element at a time so a chain of them is still
+ * a single pass. upstream has to outlive iterator. */
+void IteratorMap(Iterator *iterator, Iterator *upstream, IteratorMapFunc map, void *context);
+void IteratorFilter(Iterator *iterator, Iterator *upstream, IteratorFilterFunc filter, void *context);
+void IteratorTake(Iterator *iterator, Iterator *upstream, size_t count);
+
+
+#pragma mark Thread Pool
+
+/* A fixed set of worker threads. Each worker has its own queue and steals
+ * from the others when it runs dry. Every task runs inside its own
+ * autorelease pool on the worker. */
+typedef struct ThreadPool ThreadPool;
+
+/* 0 workers means one per online CPU. */
+ThreadPool *ThreadPoolCreate(int workerCount);
+void ThreadPoolDestroy(ThreadPool *pool);
+int ThreadPoolWorkerCount(ThreadPool *pool);
+
+
+#pragma mark Bulk Cons Operations
+
+typedef Object(*ConsMapFunc)(Object obj, void *context);
+typedef Object(*ConsReduceFunc)(Object accumulator, Object obj, void *context);
+/* Negative, zero or positive like strcmp. */
+typedef int(*ConsCompareFunc)(Object objZero, Object objOne, void *context);
+
+/* A new list of map applied to each car. */
+ConsRef ConsMap(ConsRef cons, ConsMapFunc map, void *context);
+/* Folds reduce over the cars from the front, starting with initial. */
+Object ConsReduce(ConsRef cons, ConsReduceFunc reduce, Object initial, void *context);
+/* Stable merge sort that relinks the cells rather than copying anything.
+ * Returns the new first cell, which you don't own. cons stays valid but now
+ * points somewhere inside the sorted list. If any cell is shared with someone
+ * else the list gets copied first and cons is left alone. */
+ConsRef ConsSort(ConsRef cons, ConsCompareFunc compare, void *context);
+
+/* The same, split into chunks that run on pool. The funcs get called from the
+ * workers so they need to be safe to call concurrently. Each chunk of the
+ * reduce starts from initial and the chunk results are folded together in
+ * order with combine, so initial has to be an identity for combine. */
+ConsRef ConsMapParallel(ThreadPool *pool, ConsRef cons, ConsMapFunc map, void *context);
+Object ConsReduceParallel(ThreadPool *pool, ConsRef cons, ConsReduceFunc reduce, ConsReduceFunc combine, Object initial, void *context);
+ConsRef ConsSortParallel(ThreadPool *pool, ConsRef cons, ConsCompareFunc compare, void *context);
+
+#endif
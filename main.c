@@ -9,6 +9,7 @@
 #include <stdio.h>
 
 #include "lame-obj-c.h"
+#include <stdint.h>
 #include <string.h>
 
 void AutoReleaseTest0();
@@ -18,11 +19,24 @@ void AutoReleaseTest3();
 void AutoReleaseTest4();
 
 void StringAndConsTest0();
+void StringTest1();
+void StringKernelTest0();
+void StringViewTest0();
+
+void IteratorTest0();
+
+void BulkConsTest0();
+void CopyOnWriteTest0();
+void DescriptionCacheTest0();
+void BatchTest0();
+
+void AllocatorTest0();
 
 int main(int argc, const char * argv[])
 {
     printf("Starting App\n");
-    SetupObjectSystem();
+    CountingAllocatorContext countingContext;
+    SetupObjectSystemWithAllocator(CountingAllocatorMake(&countingContext, DefaultAllocator()));
     
     AutoReleasePoolCreate();
         
@@ -33,11 +47,24 @@ int main(int argc, const char * argv[])
     AutoReleaseTest4();
 
     StringAndConsTest0();
+    StringTest1();
+    StringKernelTest0();
+    StringViewTest0();
+    
+    IteratorTest0();
+    
+    BulkConsTest0();
+    CopyOnWriteTest0();
+    DescriptionCacheTest0();
+    BatchTest0();
     
     AutoReleasePoolDrain();
     
+    AllocatorTest0();
+    
     printf("Number of cons cells made: %u\n", numberOfConsCreated());
     printf("Number of leaked cons cells: %u\n", numberOfLeakedCons());
+    printf("Number of leaked allocations: %lu\n", countingContext.allocations - countingContext.frees);
     
     printf("Ending App\n");
     return 0;
@@ -207,3 +234,426 @@ void StringAndConsTest0() {
     
     printf("Ending String Test 0\n");
 }
+
+void StringTest1() {
+    printf("Starting String Test 1\n");
+    
+    StringRef empty = AutoRelease(StringCreate(""));
+    printf("Empty length (0): %lu\n", (unsigned long)StringLength(empty));
+    
+    StringRef catted = StringConcatenate(AutoRelease(StringCreate("inline ")),
+                                         AutoRelease(StringCreate("payload")));
+    StringPrint(catted, "catted (inline payload): %s\n");
+    printf("catted length (14): %lu\n", (unsigned long)StringLength(catted));
+    printf("Equal: (YES): %s\n", StringEqual(catted, AutoRelease(StringCreate("inline payload"))) ? "YES" : "NO");
+    printf("Equal: (NO): %s\n", StringEqual(catted, AutoRelease(StringCreate("inline paylord"))) ? "YES" : "NO");
+    printf("Equal: (YES): %s\n", StringEqual(empty, StringConcatenate(empty, empty)) ? "YES" : "NO");
+    
+    printf("Ending String Test 1\n");
+}
+
+void StringKernelTest0() {
+    printf("Starting String Kernel Test 0\n");
+    
+    StringRef text = AutoRelease(StringCreate("the quick brown fox jumps over the lazy dog, "
+                                              "the quick brown fox jumps over the lazy cat, "
+                                              "the quick brown fox jumps over the lazy cow."));
+    StringRef cat = AutoRelease(StringCreate("lazy cat"));
+    StringRef cow = AutoRelease(StringCreate("cow."));
+    StringRef emu = AutoRelease(StringCreate("lazy emu"));
+    StringRef prefix = AutoRelease(StringCreate("the quick brown fox jumps over the lazy dog"));
+    
+    StringKernel originalKernel = StringKernelActive();
+    StringKernel kernels[] = { StringKernelScalar, StringKernelSSE2, StringKernelAVX2 };
+    const char *kernelNames[] = { "scalar", "sse2", "avx2" };
+    unsigned int scalarHash = 0;
+    int i = 0;
+    
+    for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        if (!StringKernelSelect(kernels[i])) {
+            continue;
+        }
+        if (kernels[i] == StringKernelScalar) {
+            scalarHash = StringHash(text);
+        }
+        
+        printf("%s find 'lazy cat' (80): %ld\n", kernelNames[i], StringFind(text, cat));
+        printf("%s find 'cow.' (130): %ld\n", kernelNames[i], StringFind(text, cow));
+        printf("%s find 'lazy emu' (-1): %ld\n", kernelNames[i], StringFind(text, emu));
+        printf("%s has prefix (YES): %s\n", kernelNames[i], StringHasPrefix(text, prefix) ? "YES" : "NO");
+        printf("%s has prefix (NO): %s\n", kernelNames[i], StringHasPrefix(text, cat) ? "YES" : "NO");
+        printf("%s hash matches scalar (YES): %s\n", kernelNames[i], StringHash(text) == scalarHash ? "YES" : "NO");
+    }
+    
+    StringKernelSelect(originalKernel);
+    
+    printf("Ending String Kernel Test 0\n");
+}
+
+static int _bytesReleasedCount = 0;
+
+void CountBytesReleased(const char *bytes, size_t length, void *context) {
+    _bytesReleasedCount++;
+}
+
+void StringViewTest0() {
+    printf("Starting String View Test 0\n");
+    
+    static const char bytes[] = "key\0value\0key\0other";
+    StringRef whole = StringCreateNoCopy(bytes, sizeof(bytes) - 1, &CountBytesReleased, NULL);
+    printf("Length with NULs (19): %lu\n", (unsigned long)StringLength(whole));
+    printf("Bytes not copied (YES): %s\n", StringBytes(whole) == bytes ? "YES" : "NO");
+    
+    StringRef value = StringCreateSubstring(whole, 4, 5);
+    StringRef valueOfValue = StringCreateSubstring(value, 1, 3);
+    /* Describing a string hands back the string itself, autoreleased. */
+    AutoReleasePoolCreate();
+    StringPrint(value, "value (value): %s\n");
+    StringPrint(valueOfValue, "valueOfValue (alu): %s\n");
+    StringPrint(AutoRelease(ConsCreate(value, nil)), "Substring in a list '(\"value\")': %s\n");
+    Iterator viewCharacters;
+    int viewCount = 0;
+    IteratorInit(&viewCharacters, valueOfValue);
+    while (IteratorNext(&viewCharacters)) {
+        viewCount++;
+    }
+    printf("Substring characters (3): %d\n", viewCount);
+    AutoReleasePoolDrain();
+    printf("Substring shares bytes (YES): %s\n", StringBytes(value) == bytes + 4 ? "YES" : "NO");
+    StringRef secondKey = StringCreateSubstring(whole, 9, 4);
+    printf("Find second key (9): %ld\n", StringFind(whole, secondKey));
+    Release(secondKey);
+    
+    Release(whole);
+    printf("Bytes released while substrings alive (0): %d\n", _bytesReleasedCount);
+    Release(value);
+    Release(valueOfValue);
+    printf("Bytes released after substrings gone (1): %d\n", _bytesReleasedCount);
+    
+    const char *path = "lame-obj-c-view-test.txt";
+    FILE *file = fopen(path, "wb");
+    if (file) {
+        fwrite(bytes, 1, sizeof(bytes) - 1, file);
+        fclose(file);
+        
+        StringRef mapped = AutoRelease(StringCreateFromFile(path));
+        printf("Mapped file matches (YES): %s\n",
+               StringEqual(mapped, AutoRelease(StringCreateNoCopy(bytes, sizeof(bytes) - 1, NULL, NULL))) ? "YES" : "NO");
+        remove(path);
+    }
+    printf("Missing file is nil (YES): %s\n", StringCreateFromFile("no/such/file") == nil ? "YES" : "NO");
+#if defined(__linux__)
+    /* Says it's 0 bytes long but isn't. */
+    StringRef proc = AutoRelease(StringCreateFromFile("/proc/self/stat"));
+    printf("Proc file read to the end (YES): %s\n", proc && StringLength(proc) > 0 && StringBytes(proc)[StringLength(proc) - 1] == '\n' ? "YES" : "NO");
+#endif
+#if defined(__unix__) || defined(__APPLE__)
+    StringRef device = AutoRelease(StringCreateFromFile("/dev/null"));
+    printf("Device length (0): %lu\n", device ? (unsigned long)StringLength(device) : 99UL);
+#endif
+    
+    printf("Ending String View Test 0\n");
+}
+
+void UppercaseCharacter(Iterator *iterator, void *context) {
+    if (iterator->character >= 'a' && iterator->character <= 'z') {
+        iterator->character -= 'a' - 'A';
+    }
+}
+
+BOOL IsNotSpace(Iterator *iterator, void *context) {
+    return iterator->character != ' ';
+}
+
+BOOL IsLongerThan(Iterator *iterator, void *context) {
+    return StringLength(iterator->object) > *(size_t *)context;
+}
+
+void IteratorTest0() {
+    printf("Starting Iterator Test 0\n");
+    
+    ConsRef list = AutoRelease(ConsCreate(AutoRelease(StringCreate("a")),
+                                          AutoRelease(ConsCreate(AutoRelease(StringCreate("bbb")),
+                                                                 AutoRelease(ConsCreate(AutoRelease(StringCreate("cc")),
+                                                                                        AutoRelease(ConsCreate(AutoRelease(StringCreate("dddd")),
+                                                                                                               nil))))))));
+    Iterator iterator;
+    int count = 0;
+    
+    IteratorInit(&iterator, list);
+    while (IteratorNext(&iterator)) {
+        count++;
+    }
+    printf("List elements (4): %d\n", count);
+    
+    IteratorInit(&iterator, nil);
+    printf("nil has elements (NO): %s\n", IteratorNext(&iterator) ? "YES" : "NO");
+    
+    size_t minimumLength = 1;
+    Iterator longOnes;
+    Iterator firstTwo;
+    IteratorInit(&iterator, list);
+    IteratorFilter(&longOnes, &iterator, &IsLongerThan, &minimumLength);
+    IteratorTake(&firstTwo, &longOnes, 2);
+    printf("Longer than 1, first two (bbb cc):");
+    while (IteratorNext(&firstTwo)) {
+        StringPrint(firstTwo.object, " %s");
+    }
+    printf("\n");
+    
+    char shouted[32];
+    size_t length = 0;
+    Iterator characters;
+    Iterator noSpaces;
+    Iterator uppercased;
+    IteratorInit(&characters, AutoRelease(StringCreate("lazy seq uence")));
+    IteratorFilter(&noSpaces, &characters, &IsNotSpace, NULL);
+    IteratorMap(&uppercased, &noSpaces, &UppercaseCharacter, NULL);
+    while (IteratorNext(&uppercased) && length < sizeof(shouted) - 1) {
+        shouted[length++] = uppercased.character;
+    }
+    shouted[length] = '\0';
+    printf("Mapped string (LAZYSEQUENCE): %s\n", shouted);
+    
+    printf("Ending Iterator Test 0\n");
+}
+
+/* Records look like "k3-0042": sorting only looks at the key digit, the rest
+ * is there to check equal keys kept their order. */
+int CompareRecordKeys(Object objZero, Object objOne, void *context) {
+    return StringBytes(objZero)[1] - StringBytes(objOne)[1];
+}
+
+Object RecordKey(Object obj, void *context) {
+    return AutoRelease(StringCreateSubstring(obj, 0, 2));
+}
+
+Object LongerString(Object accumulator, Object obj, void *context) {
+    return StringLength(obj) > StringLength(accumulator) ? obj : accumulator;
+}
+
+BOOL IsSortedAndStable(ConsRef list) {
+    Iterator iterator;
+    const char *previous = NULL;
+    
+    IteratorInit(&iterator, list);
+    while (IteratorNext(&iterator)) {
+        const char *current = StringBytes(iterator.object);
+        if (previous && (previous[1] > current[1] || (previous[1] == current[1] && strncmp(previous + 3, current + 3, 4) > 0))) {
+            return NO;
+        }
+        previous = current;
+    }
+    return YES;
+}
+
+void BulkConsTest0() {
+    printf("Starting Bulk Cons Test 0\n");
+    
+    int count = 1000;
+    int i = 0;
+    ConsRef records = nil;
+    ConsRef otherRecords = nil;
+    char record[16];
+    
+    /* Built back to front so record numbers go up along the list. */
+    for (i = count - 1; i >= 0; i--) {
+        sprintf(record, "k%d-%04d", (i * 7) % 10, i);
+        StringRef recordString = StringCreate(record);
+        ConsRef newRecords = ConsCreate(recordString, records);
+        ConsRef newOtherRecords = ConsCreate(recordString, otherRecords);
+        Release(recordString);
+        Release(records);
+        Release(otherRecords);
+        records = newRecords;
+        otherRecords = newOtherRecords;
+    }
+    
+    ThreadPool *pool = ThreadPoolCreate(4);
+    
+    ConsRef keys = ConsMap(records, &RecordKey, NULL);
+    ConsRef parallelKeys = ConsMapParallel(pool, records, &RecordKey, NULL);
+    printf("Mapped lengths (1000 1000): %d %d\n", ConsLength(keys), ConsLength(parallelKeys));
+    StringPrint(ConsCar(ConsCdr(ConsCdr(parallelKeys))), "Third key (k4): %s\n");
+    
+    StringRef empty = AutoRelease(StringCreate(""));
+    StringRef longest = ConsReduce(records, &LongerString, empty, NULL);
+    StringRef parallelLongest = ConsReduceParallel(pool, records, &LongerString, &LongerString, empty, NULL);
+    StringPrint(longest, "Longest (k0-0000): %s\n");
+    StringPrint(parallelLongest, "Parallel longest (k0-0000): %s\n");
+    
+    ConsRef sorted = ConsSort(records, &CompareRecordKeys, NULL);
+    Retain(sorted);
+    Release(records);
+    printf("Sorted length (1000): %d\n", ConsLength(sorted));
+    printf("Sorted and stable (YES): %s\n", IsSortedAndStable(sorted) ? "YES" : "NO");
+    
+    ConsRef parallelSorted = ConsSortParallel(pool, otherRecords, &CompareRecordKeys, NULL);
+    Retain(parallelSorted);
+    Release(otherRecords);
+    printf("Parallel sorted length (1000): %d\n", ConsLength(parallelSorted));
+    printf("Parallel sorted and stable (YES): %s\n", IsSortedAndStable(parallelSorted) ? "YES" : "NO");
+    
+    ConsRef cons = sorted;
+    ConsRef parallelCons = parallelSorted;
+    while (cons && parallelCons && ConsCar(cons) == ConsCar(parallelCons)) {
+        cons = ConsCdr(cons);
+        parallelCons = ConsCdr(parallelCons);
+    }
+    printf("Same order both ways (YES): %s\n", !cons && !parallelCons ? "YES" : "NO");
+    
+    Release(sorted);
+    Release(parallelSorted);
+    ThreadPoolDestroy(pool);
+    
+    printf("Ending Bulk Cons Test 0\n");
+}
+
+int CompareChars(Object objZero, Object objOne, void *context) {
+    return CharCChar(objZero) - CharCChar(objOne);
+}
+
+void CopyOnWriteTest0() {
+    printf("Starting Copy On Write Test 0\n");
+    
+    CharRef a = AutoRelease(CharCreate('a'));
+    CharRef b = AutoRelease(CharCreate('b'));
+    CharRef c = AutoRelease(CharCreate('c'));
+    ConsRef list = AutoRelease(ConsCreate(a, nil));
+    
+    ConsRef copy = ConsCopy(list);
+    printf("Copy is the same cells (YES): %s\n", copy == list ? "YES" : "NO");
+    
+    /* Both of us hold it now, so adding has to leave list alone. */
+    ConsRef added = ConsAddToEnd(copy, b);
+    printf("Shared add lengths (1 2): %d %d\n", ConsLength(list), ConsLength(added));
+    Release(copy);
+    
+    /* Only ours again, so this one goes on in place. */
+    printf("Unshared add in place (YES): %s\n", ConsAddToEnd(list, b) == list ? "YES" : "NO");
+    printf("Unshared add length (2): %d\n", ConsLength(list));
+    
+    /* Someone else holding the tail only costs copying the tail. */
+    ConsRef tail = ConsCdr(list);
+    Retain(tail);
+    ConsAddToEnd(list, c);
+    printf("Shared tail lengths (3 1): %d %d\n", ConsLength(list), ConsLength(tail));
+    printf("Shared tail copied (YES): %s\n", ConsCdr(list) != tail ? "YES" : "NO");
+    
+    /* Sorting a shared list sorts a copy. */
+    ConsRef pushed = ConsPush(tail, c);
+    ConsRef sorted = ConsSort(pushed, &CompareChars, NULL);
+    printf("Sorted copy starts with (b): %c\n", CharCChar(ConsCar(sorted)));
+    printf("Shared list untouched (c b): %c %c\n", CharCChar(ConsCar(pushed)), CharCChar(ConsCar(ConsCdr(pushed))));
+    Release(tail);
+    
+    printf("Ending Copy On Write Test 0\n");
+}
+
+void DescriptionCacheTest0() {
+    printf("Starting Description Cache Test 0\n");
+    AutoReleasePoolCreate();
+    
+    ConsRef inner = AutoRelease(ConsCreate(AutoRelease(CharCreate('q')), nil));
+    ConsRef list = AutoRelease(ConsCreate(AutoRelease(StringCreate("a")),
+                                          AutoRelease(ConsCreate(inner, nil))));
+    
+    StringRef first = Description(list);
+    printf("Second description is cached (YES): %s\n", Description(list) == first ? "YES" : "NO");
+    StringPrint(list, "Cached list '(\"a\" (q))': %s\n");
+    
+    /* Changing something the cached text went through has to show up. */
+    ConsSetCar(inner, AutoRelease(CharCreate('w')));
+    StringPrint(list, "After inner change '(\"a\" (w))': %s\n");
+    ConsAddToEnd(list, AutoRelease(StringCreate("b")));
+    StringPrint(list, "After add '(\"a\" (w) \"b\")': %s\n");
+    
+    /* Over half the cache budget, so it only fits again once the stale
+     * entry it replaces has been let go. */
+    StringRef forty = AutoRelease(StringCreate("0123456789012345678901234567890123456789"));
+    ConsRef big = nil;
+    int i = 0;
+    for (i = 0; i < 120000; i++) {
+        ConsRef bigger = ConsCreate(forty, big);
+        Release(big);
+        big = bigger;
+    }
+    AutoRelease(big);
+    printf("Big list cached (YES): %s\n", Description(big) == Description(big) ? "YES" : "NO");
+    ConsSetCar(big, ConsCar(big));
+    printf("Big list cached again after a change (YES): %s\n", Description(big) == Description(big) ? "YES" : "NO");
+    
+    /* No bytes at all behind this one. */
+    ConsRef empty = AutoRelease(ConsCreate(AutoRelease(StringCreateNoCopy(NULL, 0, NULL, NULL)), nil));
+    StringPrint(empty, "Empty string in a list '(\"\")': %s\n");
+    
+    AutoReleasePoolDrain();
+    printf("Ending Description Cache Test 0\n");
+}
+
+void BatchTest0() {
+    printf("Starting Batch Test 0\n");
+    AutoReleasePoolCreate();
+    
+    CharRef a = CharCreate('a');
+    CharRef b = CharCreate('b');
+    Object objects[] = { a, a, a, nil, b, a };
+    size_t count = sizeof(objects) / sizeof(objects[0]);
+    
+    RetainMany(objects, count);
+    printf("Retained many (5 2): %u %u\n", RetainCount(a), RetainCount(b));
+    ReleaseMany(objects, count);
+    printf("Released many (1 1): %u %u\n", RetainCount(a), RetainCount(b));
+    
+    ConsRef list = ConsCreateFromArray(objects, count);
+    printf("List from array length (6): %d\n", ConsLength(list));
+    StringPrint(list, "List from array '(a a a NIL b a)': %s\n");
+    printf("Cars retained (5 2): %u %u\n", RetainCount(a), RetainCount(b));
+    Release(list);
+    printf("Empty array is nil (YES): %s\n", ConsCreateFromArray(objects, 0) == nil ? "YES" : "NO");
+    
+    /* The pool takes over a and b, the way AutoRelease would. */
+    Object owned[] = { a, b };
+    AutoReleaseMany(owned, 2);
+    printf("Autoreleased many still alive (1 1): %u %u\n", RetainCount(a), RetainCount(b));
+    
+    AutoReleasePoolDrain();
+    printf("Ending Batch Test 0\n");
+}
+
+void AllocatorTest0() {
+    printf("Starting Allocator Test 0\n");
+    
+    ObjectAllocator previousAllocator = ObjectSystemAllocator();
+    StringKernel previousKernel = StringKernelActive();
+    StringKernelSelect(StringKernelScalar);
+    
+    static char buffer[64 * 1024];
+    BumpAllocatorContext bumpContext;
+    SetupObjectSystemWithAllocator(BumpAllocatorMake(&bumpContext, buffer, sizeof(buffer)));
+    
+    AutoReleasePoolCreate();
+    ConsRef cons = ConsCreate(AutoRelease(StringCreate("bump")), nil);
+    StringPrint(cons, "cons '(\"bump\")': %s\n");
+    Release(cons);
+    AutoReleasePoolDrain();
+    
+    printf("Bump allocator used some memory (YES): %s\n", bumpContext.offset > 0 ? "YES" : "NO");
+    BumpAllocatorReset(&bumpContext);
+    
+    /* Objects still come out aligned when the buffer isn't. */
+    SetupObjectSystemWithAllocator(BumpAllocatorMake(&bumpContext, buffer + 1, sizeof(buffer) - 1));
+    CharRef first = CharCreate('x');
+    CharRef second = CharCreate('y');
+    printf("Bump allocations aligned (YES): %s\n",
+           (uintptr_t)first % 16 == 0 && (uintptr_t)second % 16 == 0 ? "YES" : "NO");
+    Release(first);
+    Release(second);
+    BumpAllocatorReset(&bumpContext);
+    
+    SetupObjectSystemWithAllocator(previousAllocator);
+    printf("Switching allocators keeps the kernel (YES): %s\n", StringKernelActive() == StringKernelScalar ? "YES" : "NO");
+    StringKernelSelect(previousKernel);
+    
+    printf("Ending Allocator Test 0\n");
+}